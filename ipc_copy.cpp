@@ -0,0 +1,184 @@
+#include "ipc_copy.h"
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IPC_COPY_X86 1
+#endif
+
+namespace
+{
+    using CopyFn = void (*)(void *, const void *, std::size_t);
+
+    // Head of a slot prefetched, the hardware prefetcher follows the rest of a sequential copy
+    constexpr std::size_t prefetch_bytes = 4096;
+    constexpr std::size_t cache_line = 64;
+
+    std::size_t InitThreshold(const char *var, std::size_t value)
+    {
+        const char *env = getenv(var);
+        if (env != nullptr && env[0] != '\0')
+        {
+            return static_cast<std::size_t>(strtoull(env, nullptr, 0));
+        }
+        return value;
+    }
+
+    // Function statics, valid for channels set up by static constructors of other files too
+    std::atomic<std::size_t> &ThresholdVar()
+    {
+        static std::atomic<std::size_t> threshold{InitThreshold("IPC_COPY_THRESHOLD", 256 * 1024)};
+        return threshold;
+    }
+
+    std::atomic<std::size_t> &PrefetchThresholdVar()
+    {
+        static std::atomic<std::size_t> threshold{InitThreshold("IPC_PREFETCH_THRESHOLD", 16 * 1024)};
+        return threshold;
+    }
+
+    void MemCopy(void *dst, const void *src, std::size_t size)
+    {
+        memcpy(dst, src, size);
+    }
+
+#ifdef IPC_COPY_X86
+    // Bytes up to the next align boundary of dst, copied plainly before the aligned streaming stores
+    inline std::size_t HeadOf(const void *dst, std::size_t align, std::size_t size)
+    {
+        std::size_t head = (align - (reinterpret_cast<std::uintptr_t>(dst) & (align - 1))) & (align - 1);
+        return head < size ? head : size;
+    }
+
+    __attribute__((target("sse2"))) void StoreSse2(void *dst, const void *src, std::size_t size)
+    {
+        auto d = static_cast<std::uint8_t *>(dst);
+        auto s = static_cast<const std::uint8_t *>(src);
+        std::size_t head = HeadOf(d, 16, size);
+        memcpy(d, s, head);
+        d += head, s += head, size -= head;
+        for (; size >= 64; d += 64, s += 64, size -= 64)
+        {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 16));
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 32));
+            __m128i e = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 48));
+            _mm_stream_si128(reinterpret_cast<__m128i *>(d), a);
+            _mm_stream_si128(reinterpret_cast<__m128i *>(d + 16), b);
+            _mm_stream_si128(reinterpret_cast<__m128i *>(d + 32), c);
+            _mm_stream_si128(reinterpret_cast<__m128i *>(d + 48), e);
+        }
+        _mm_sfence();
+        memcpy(d, s, size);
+    }
+
+    __attribute__((target("avx2"))) void StoreAvx2(void *dst, const void *src, std::size_t size)
+    {
+        auto d = static_cast<std::uint8_t *>(dst);
+        auto s = static_cast<const std::uint8_t *>(src);
+        std::size_t head = HeadOf(d, 32, size);
+        memcpy(d, s, head);
+        d += head, s += head, size -= head;
+        for (; size >= 128; d += 128, s += 128, size -= 128)
+        {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s));
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + 32));
+            __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + 64));
+            __m256i e = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + 96));
+            _mm256_stream_si256(reinterpret_cast<__m256i *>(d), a);
+            _mm256_stream_si256(reinterpret_cast<__m256i *>(d + 32), b);
+            _mm256_stream_si256(reinterpret_cast<__m256i *>(d + 64), c);
+            _mm256_stream_si256(reinterpret_cast<__m256i *>(d + 96), e);
+        }
+        _mm_sfence();
+        memcpy(d, s, size);
+    }
+#endif
+
+    struct CopyEngine
+    {
+        CopyFn store;
+        const char *name;
+    };
+
+    CopyEngine Select()
+    {
+#ifdef IPC_COPY_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            return {StoreAvx2, "avx2"};
+        }
+        if (__builtin_cpu_supports("sse2"))
+        {
+            return {StoreSse2, "sse2"};
+        }
+#endif
+        return {MemCopy, "memcpy"};
+    }
+
+    // Resolved once on first use
+    const CopyEngine &Current()
+    {
+        static const CopyEngine engine = Select();
+        return engine;
+    }
+
+} // internal-linkage
+
+namespace ipc
+{
+    namespace copy
+    {
+        void Store(void *dst, const void *src, std::size_t size)
+        {
+            Current().store(dst, src, size);
+        }
+
+        void Load(void *dst, const void *src, std::size_t size)
+        {
+            Prefetch(src, size);
+            memcpy(dst, src, size);
+        }
+
+        void Prefetch(const void *src, std::size_t size)
+        {
+            auto s = static_cast<const char *>(src);
+            std::size_t end = size < prefetch_bytes ? size : prefetch_bytes;
+            for (std::size_t off = 0; off < end; off += cache_line)
+            {
+                __builtin_prefetch(s + off, 0, 3);
+            }
+        }
+
+        std::size_t Threshold()
+        {
+            return ThresholdVar().load(std::memory_order_relaxed);
+        }
+
+        void SetThreshold(std::size_t size)
+        {
+            ThresholdVar().store(size, std::memory_order_relaxed);
+        }
+
+        std::size_t PrefetchThreshold()
+        {
+            return PrefetchThresholdVar().load(std::memory_order_relaxed);
+        }
+
+        void SetPrefetchThreshold(std::size_t size)
+        {
+            PrefetchThresholdVar().store(size, std::memory_order_relaxed);
+        }
+
+        const char *Engine()
+        {
+            return Current().name;
+        }
+    } // namespace copy
+} // namespace ipc
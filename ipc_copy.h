@@ -0,0 +1,78 @@
+#ifndef IPC_COPY_H
+#define IPC_COPY_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace ipc
+{
+    namespace copy
+    {
+        // Copy into a shared slot with non-temporal stores, so a writer does not fill its cache with
+        // data it never reads again. Ordered before later stores, like the flag publishing the slot.
+        void Store(void *dst, const void *src, std::size_t size);
+        // Copy out of a shared slot, prefetching the source ahead of the copy
+        void Load(void *dst, const void *src, std::size_t size);
+        // Start fetching the head of a slot about to be read
+        void Prefetch(const void *src, std::size_t size);
+
+        // Payloads from this size on go through Store / Load, smaller ones through memcpy.
+        // Defaults to the IPC_COPY_THRESHOLD environment variable, or 256 KiB, tune it with `test c`.
+        std::size_t Threshold();
+        // Values below min_size act as min_size.
+        void SetThreshold(std::size_t size);
+        // A reader prefetches the next pending message from this size on. Defaults to the
+        // IPC_PREFETCH_THRESHOLD environment variable, or 16 KiB, tune it with `test c`.
+        std::size_t PrefetchThreshold();
+        void SetPrefetchThreshold(std::size_t size);
+        // Instruction set picked on first use: "avx2", "sse2" or "memcpy"
+        const char *Engine();
+
+        // Below this the engine never pays off, small payloads skip the threshold lookup
+        constexpr std::size_t min_size = 1024;
+
+        template <typename T>
+        inline bool UseEngine()
+        {
+            return std::is_trivially_copyable<T>::value && sizeof(T) >= min_size && sizeof(T) >= Threshold();
+        }
+
+        template <typename T>
+        inline bool UsePrefetch()
+        {
+            return sizeof(T) >= PrefetchThreshold();
+        }
+
+        // Construct a copy of src in the raw storage of a slot
+        template <typename T>
+        inline void StoreObject(void *dst, const T &src)
+        {
+            if (UseEngine<T>())
+            {
+                Store(dst, &src, sizeof(T));
+            }
+            else
+            {
+                new (dst) T(src);
+            }
+        }
+
+        // Construct dst from the slot object at src, moving what is not trivially copyable
+        template <typename T>
+        inline void LoadObject(T &dst, void *src)
+        {
+            if (UseEngine<T>())
+            {
+                Load(&dst, src, sizeof(T));
+            }
+            else
+            {
+                new (&dst) T(std::move(*static_cast<T *>(src)));
+            }
+        }
+    } // namespace copy
+} // namespace ipc
+
+#endif
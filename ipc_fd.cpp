@@ -0,0 +1,183 @@
+#include "ipc_fd.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+
+#include <cstddef>
+#include <cstring>
+#include <limits>
+
+#include "ipc_trace.h"
+
+namespace
+{
+    // Length of the address of name, 0 if it does not fit: truncated, two names could share a socket
+    socklen_t MakeAddr(const std::string &name, sockaddr_un &addr)
+    {
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        // Abstract namespace: leading NUL, not NUL terminated
+        std::string path = "simple_ipc." + name;
+        if (path.size() > sizeof(addr.sun_path) - 1)
+        {
+            IPC_LOG_ERROR("fail socket address: %s, name longer than %zd", name.c_str(), sizeof(addr.sun_path) - 1 - (path.size() - name.size()));
+            return 0;
+        }
+        std::memcpy(addr.sun_path + 1, path.data(), path.size());
+        return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + 1 + path.size());
+    }
+
+    int WaitMs(std::size_t tm)
+    {
+        return tm >= static_cast<std::size_t>((std::numeric_limits<int>::max)()) ? -1 : static_cast<int>(tm);
+    }
+
+} // internal-linkage
+
+namespace ipc
+{
+    namespace fd
+    {
+        int Listen(const std::string &name)
+        {
+            sockaddr_un addr;
+            socklen_t len = MakeAddr(name, addr);
+            if (len == 0)
+            {
+                return -1;
+            }
+            int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (sock == -1)
+            {
+                IPC_LOG_ERROR("fail socket[%d]: %s", errno, name.c_str());
+                return -1;
+            }
+            if (bind(sock, reinterpret_cast<sockaddr *>(&addr), len) != 0 || listen(sock, 16) != 0)
+            {
+                IPC_LOG_ERROR("fail bind/listen[%d]: %s", errno, name.c_str());
+                close(sock);
+                return -1;
+            }
+            return sock;
+        }
+
+        int Accept(int listen_fd, std::size_t tm)
+        {
+            pollfd pfd = {listen_fd, POLLIN, 0};
+            if (poll(&pfd, 1, WaitMs(tm)) <= 0)
+            {
+                return -1;
+            }
+            int sock = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (sock == -1)
+            {
+                IPC_LOG_ERROR("fail accept4[%d]", errno);
+            }
+            return sock;
+        }
+
+        int Connect(const std::string &name)
+        {
+            sockaddr_un addr;
+            socklen_t len = MakeAddr(name, addr);
+            if (len == 0)
+            {
+                return -1;
+            }
+            int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (sock == -1)
+            {
+                IPC_LOG_ERROR("fail socket[%d]: %s", errno, name.c_str());
+                return -1;
+            }
+            if (connect(sock, reinterpret_cast<sockaddr *>(&addr), len) != 0)
+            {
+                close(sock);
+                return -1;
+            }
+            return sock;
+        }
+
+        bool PeerAllowed(int sock)
+        {
+            ucred cred;
+            socklen_t len = sizeof(cred);
+            if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+            {
+                IPC_LOG_ERROR("fail getsockopt SO_PEERCRED[%d]", errno);
+                return false;
+            }
+            return cred.uid == geteuid() || cred.uid == 0;
+        }
+
+        bool Send(int sock, int fd)
+        {
+            char byte = 0;
+            iovec iov = {&byte, 1};
+            alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof(int))];
+            msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = ctrl;
+            msg.msg_controllen = sizeof(ctrl);
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+            if (sendmsg(sock, &msg, MSG_NOSIGNAL) != 1)
+            {
+                IPC_LOG_ERROR("fail sendmsg[%d]", errno);
+                return false;
+            }
+            return true;
+        }
+
+        int Recv(int sock, std::size_t tm)
+        {
+            pollfd pfd = {sock, POLLIN, 0};
+            int ret = poll(&pfd, 1, WaitMs(tm));
+            if (ret <= 0)
+            {
+                if (ret == 0)
+                {
+                    errno = ETIMEDOUT;
+                }
+                return -1;
+            }
+            char byte = 0;
+            iovec iov = {&byte, 1};
+            alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof(int))];
+            msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = ctrl;
+            msg.msg_controllen = sizeof(ctrl);
+            ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+            if (n != 1)
+            {
+                // Closed without a descriptor, e.g. the writer rejected this process
+                if (n == 0)
+                {
+                    errno = ECONNRESET;
+                }
+                IPC_LOG_ERROR("fail recvmsg[%d]", errno);
+                return -1;
+            }
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            {
+                IPC_LOG_ERROR("fail recvmsg: no descriptor");
+                return -1;
+            }
+            int fd;
+            std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            return fd;
+        }
+    } // namespace fd
+} // namespace ipc
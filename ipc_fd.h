@@ -0,0 +1,30 @@
+#ifndef IPC_FD_H
+#define IPC_FD_H
+
+#include <cstddef>
+#include <string>
+
+// Hand file descriptors between processes over Unix-domain sockets (SCM_RIGHTS).
+// Sockets live in the abstract namespace, so nothing is left behind in the file system.
+namespace ipc
+{
+    namespace fd
+    {
+        // Listening socket for name, -1 on failure, e.g. when the name does not fit a socket address
+        int Listen(const std::string &name);
+        // Accept one peer within tm ms, -1 on timeout or failure
+        int Accept(int listen_fd, std::size_t tm);
+        // Connected socket to the listener of name, -1 on failure
+        int Connect(const std::string &name);
+
+        // Only peers running as the same user (or root) are authorized.
+        // Checked on both ends: the listener of a name is not necessarily its writer.
+        bool PeerAllowed(int sock);
+
+        bool Send(int sock, int fd);
+        // Descriptor received within tm ms, -1 on failure, with errno ETIMEDOUT if none arrived yet
+        int Recv(int sock, std::size_t tm);
+    } // namespace fd
+} // namespace ipc
+
+#endif
@@ -1,14 +1,27 @@
 #include "ipc_lock.h"
 
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+// futex_waitv is not known to older kernel headers, the number is the same on every architecture
+#ifndef SYS_futex_waitv
+#define SYS_futex_waitv 449
+#endif
+
 #pragma push_macro("IPC_PTHREAD_FUNC_")
 #undef IPC_PTHREAD_FUNC_
-#define IPC_PTHREAD_FUNC_(CALL, ...)          \
-    int eno;                                  \
-    if ((eno = CALL(__VA_ARGS__)) != 0)       \
-    {                                         \
-        printf("fail " #CALL " [%d]\n", eno); \
-        return false;                         \
-    }                                         \
+#define IPC_PTHREAD_FUNC_(CALL, ...)                \
+    int eno;                                        \
+    if ((eno = CALL(__VA_ARGS__)) != 0)             \
+    {                                               \
+        IPC_LOG_ERROR("fail " #CALL " [%d]", eno);  \
+        return false;                               \
+    }                                               \
     return true
 
 pthread_mutex_t &Mutex::Native()
@@ -16,34 +29,40 @@ pthread_mutex_t &Mutex::Native()
     return mutex_;
 }
 
-bool Mutex::Open()
+bool Mutex::Open(bool prio_inherit)
 {
     int eno;
     // init mutex
     pthread_mutexattr_t mutex_attr;
     if ((eno = pthread_mutexattr_init(&mutex_attr)) != 0)
     {
-        printf("fail pthread_mutexattr_init[%d]\n", eno);
+        IPC_LOG_ERROR("fail pthread_mutexattr_init[%d]", eno);
         return false;
     }
     if ((eno = pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED)) != 0)
     {
-        printf("fail pthread_mutexattr_setpshared[%d]\n", eno);
+        IPC_LOG_ERROR("fail pthread_mutexattr_setpshared[%d]", eno);
         return false;
     }
     if ((eno = pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST)) != 0)
     {
-        printf("fail pthread_mutexattr_setrobust[%d]\n", eno);
+        IPC_LOG_ERROR("fail pthread_mutexattr_setrobust[%d]", eno);
+        return false;
+    }
+    if (prio_inherit && (eno = pthread_mutexattr_setprotocol(&mutex_attr, PTHREAD_PRIO_INHERIT)) != 0)
+    {
+        IPC_LOG_ERROR("fail pthread_mutexattr_setprotocol[%d]", eno);
         return false;
     }
+    prio_inherit_ = prio_inherit;
     if ((eno = pthread_mutex_init(&mutex_, &mutex_attr)) != 0)
     {
-        printf("fail pthread_mutex_init[%d]\n", eno);
+        IPC_LOG_ERROR("fail pthread_mutex_init[%d]", eno);
         return false;
     }
     if ((eno = pthread_mutexattr_destroy(&mutex_attr)) != 0)
     {
-        printf("fail pthread_mutexattr_destroy[%d]\n", eno);
+        IPC_LOG_ERROR("fail pthread_mutexattr_destroy[%d]", eno);
         return false;
     }
     return true;
@@ -56,12 +75,14 @@ bool Mutex::Close()
 
 bool Mutex::Lock()
 {
+    IPC_TRACE_CLOCK(start);
     for (;;)
     {
         int eno = pthread_mutex_lock(&mutex_);
         switch (eno)
         {
         case 0:
+            IPC_TRACE(lock_wait, ipc::trace::NowNs() - start, 0);
             return true;
         case EOWNERDEAD:
             if (::pthread_mutex_consistent(&mutex_) == 0)
@@ -70,12 +91,12 @@ bool Mutex::Lock()
                 break;
             }
         case ENOTRECOVERABLE:
-            if (Close() && Open())
+            if (Close() && Open(prio_inherit_))
             {
                 break;
             }
         default:
-            printf("fail pthread_mutex_lock[%d]\n", eno);
+            IPC_LOG_ERROR("fail pthread_mutex_lock[%d]", eno);
             return false;
         }
     }
@@ -86,79 +107,221 @@ bool Mutex::Unlock()
     IPC_PTHREAD_FUNC_(pthread_mutex_unlock, &mutex_);
 }
 
-bool ConditionVar::Open()
+LockHolder::~LockHolder()
 {
-    int eno;
-    // init condition
-    pthread_condattr_t cond_attr;
-    if ((eno = pthread_condattr_init(&cond_attr)) != 0)
+    Release();
+}
+
+bool LockHolder::Acquire(Mutex &mtx)
+{
+    Release();
+    done_ = false;
+    locked_ = false;
+    release_ = false;
+    thread_ = std::thread(&LockHolder::Hold, this, &mtx);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this]
+               { return done_; });
+    bool ok = locked_;
+    lock.unlock();
+    if (!ok)
     {
-        printf("fail pthread_condattr_init[%d]\n", eno);
-        return false;
+        thread_.join();
     }
-    if ((eno = pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED)) != 0)
+    return ok;
+}
+
+void LockHolder::Hold(Mutex *mtx)
+{
+    bool ok = mtx->Lock();
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_ = true;
+    locked_ = ok;
+    cond_.notify_all();
+    if (!ok)
     {
-        printf("fail pthread_condattr_setpshared[%d]\n", eno);
-        return false;
+        return;
     }
-    if ((eno = pthread_cond_init(&cond_, &cond_attr)) != 0)
+    cond_.wait(lock, [this]
+               { return release_; });
+    mtx->Unlock();
+}
+
+void LockHolder::Release()
+{
+    if (!thread_.joinable())
     {
-        printf("fail pthread_cond_init[%d]\n", eno);
-        return false;
+        return;
     }
-    if ((eno = pthread_condattr_destroy(&cond_attr)) != 0)
     {
-        printf("fail pthread_condattr_destroy[%d]\n", eno);
-        return false;
+        std::lock_guard<std::mutex> lock(mutex_);
+        release_ = true;
     }
+    cond_.notify_all();
+    thread_.join();
+}
+
+bool ConditionVar::Open()
+{
+    seq_.store(0, std::memory_order_relaxed);
+    waiters_.store(0, std::memory_order_relaxed);
     return true;
 }
 
 bool ConditionVar::Close()
 {
-    IPC_PTHREAD_FUNC_(pthread_cond_destroy, &cond_);
+    return true;
 }
 
 bool ConditionVar::Wait(Mutex &mtx, std::size_t tm = invalid_value)
 {
-    switch (tm)
+    if (tm == 0)
     {
-    case 0:
         return false;
-    case invalid_value:
-        IPC_PTHREAD_FUNC_(pthread_cond_wait, &cond_, &mtx.Native());
-    default:
+    }
+    timespec ts;
+    ts.tv_sec = static_cast<time_t>(tm / 1000);
+    ts.tv_nsec = static_cast<long>(tm % 1000) * 1000000;
+
+    // Read under the mutex: a notification sent after unlocking changes it and FUTEX_WAIT returns at once
+    std::uint32_t seq = seq_.load(std::memory_order_acquire);
+    waiters_.fetch_add(1);
+    mtx.Unlock();
+    // Not FUTEX_PRIVATE_FLAG, the word is shared between processes. The timeout is relative.
+    long ret = syscall(SYS_futex, &seq_, FUTEX_WAIT, seq, tm == invalid_value ? nullptr : &ts, nullptr, 0);
+    int eno = ret == 0 ? 0 : errno;
+    waiters_.fetch_sub(1, std::memory_order_relaxed);
+    if (!mtx.Lock())
     {
-        timespec ts;
-        if (!CalcWaitTime(ts, tm))
-        {
-            printf("fail CalcWaitTime: tm = %zd, tv_sec = %ld, tv_nsec = %ld\n",
-                   tm, ts.tv_sec, ts.tv_nsec);
-            return false;
-        }
-        int eno;
-        if ((eno = pthread_cond_timedwait(&cond_, &mtx.Native(), &ts)) != 0)
-        {
-            if (eno != ETIMEDOUT)
-            {
-                printf("fail pthread_cond_timedwait[%d]: tm = %zd, tv_sec = %ld, tv_nsec = %ld\n",
-                       eno, tm, ts.tv_sec, ts.tv_nsec);
-            }
-            return false;
-        }
+        return false;
     }
+    switch (eno)
+    {
+    case 0:
+    case EAGAIN:
+    case EINTR:
         return true;
+    case ETIMEDOUT:
+        return false;
+    default:
+        IPC_LOG_ERROR("fail futex wait[%d]: tm = %zd", eno, tm);
+        return false;
     }
 }
 
 bool ConditionVar::Notify()
 {
-    IPC_PTHREAD_FUNC_(pthread_cond_signal, &cond_);
+    return Wake(1);
 }
 
 bool ConditionVar::Broadcast()
 {
-    IPC_PTHREAD_FUNC_(pthread_cond_broadcast, &cond_);
+    return Wake((std::numeric_limits<int>::max)());
+}
+
+std::uint32_t ConditionVar::Sequence() const
+{
+    return seq_.load(std::memory_order_acquire);
+}
+
+namespace
+{
+    // struct futex_waitv of linux/futex.h
+    struct FutexWaitv
+    {
+        std::uint64_t val;
+        std::uint64_t uaddr;
+        std::uint32_t flags;
+        std::uint32_t reserved;
+    };
+
+    // FUTEX2_SIZE_U32, shared between processes. futex_waitv takes at most 128 words.
+    constexpr std::uint32_t futex2_size_u32 = 0x02;
+    constexpr std::size_t futex_waitv_max = 128;
+
+    std::atomic_bool no_futex_waitv{false};
+} // internal-linkage
+
+bool ConditionVar::WaitAny(ConditionVar *const *conds, const std::uint32_t *seqs, std::size_t count, std::size_t tm)
+{
+    if (count == 0 || tm == 0)
+    {
+        return false;
+    }
+    if (count > futex_waitv_max || no_futex_waitv.load(std::memory_order_relaxed))
+    {
+        // One at a time, so a notification of another one is seen within 1 ms
+        std::size_t turn = std::min<std::size_t>(tm, 1);
+        timespec ts = {0, static_cast<long>(turn) * 1000000};
+        conds[0]->waiters_.fetch_add(1);
+        long ret = syscall(SYS_futex, &conds[0]->seq_, FUTEX_WAIT, seqs[0], &ts, nullptr, 0);
+        int eno = ret == 0 ? 0 : errno;
+        conds[0]->waiters_.fetch_sub(1, std::memory_order_relaxed);
+        return eno != ETIMEDOUT || turn < tm;
+    }
+
+    std::vector<FutexWaitv> waitv(count);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        waitv[i].val = seqs[i];
+        waitv[i].uaddr = reinterpret_cast<std::uintptr_t>(&conds[i]->seq_);
+        waitv[i].flags = futex2_size_u32;
+        waitv[i].reserved = 0;
+        // Counted before the wait, a notification sent in between changes the word and the wait returns at once
+        conds[i]->waiters_.fetch_add(1);
+    }
+    // The timeout of futex_waitv is absolute
+    timespec ts;
+    if (tm != invalid_value)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += static_cast<time_t>(tm / 1000);
+        ts.tv_nsec += static_cast<long>(tm % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+    }
+    long ret = syscall(SYS_futex_waitv, waitv.data(), static_cast<unsigned>(count), 0,
+                       tm == invalid_value ? nullptr : &ts, CLOCK_MONOTONIC);
+    int eno = ret >= 0 ? 0 : errno;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        conds[i]->waiters_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    switch (eno)
+    {
+    case 0:
+    case EAGAIN:
+    case EINTR:
+        return true;
+    case ETIMEDOUT:
+        return false;
+    case ENOSYS:
+        no_futex_waitv = true;
+        return true;
+    default:
+        IPC_LOG_ERROR("fail futex_waitv[%d]: count = %zd, tm = %zd", eno, count, tm);
+        return false;
+    }
+}
+
+bool ConditionVar::Wake(int count)
+{
+    // Sequentially consistent, so a waiter registered before the bump is never missed
+    seq_.fetch_add(1);
+    if (waiters_.load() == 0)
+    {
+        return true;
+    }
+    if (syscall(SYS_futex, &seq_, FUTEX_WAKE, count, nullptr, nullptr, 0) == -1)
+    {
+        IPC_LOG_ERROR("fail futex wake[%d]", errno);
+        return false;
+    }
+    return true;
 }
 
 #pragma pop_macro("IPC_PTHREAD_FUNC_")
@@ -10,6 +10,11 @@
 
 #include <limits>
 #include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "ipc_trace.h"
 
 enum : std::size_t
 {
@@ -22,41 +27,71 @@ class Mutex
 public:
     pthread_mutex_t &Native();
 
-    bool Open();
+    // With prio_inherit, a low-priority holder is boosted while a higher-priority thread waits
+    bool Open(bool prio_inherit = false);
     bool Close();
     bool Lock();
     bool Unlock();
 
 private:
     pthread_mutex_t mutex_ = PTHREAD_MUTEX_INITIALIZER;
+    // Kept to re-open the mutex in the same mode when it is not recoverable
+    bool prio_inherit_ = false;
+};
+
+// Keeps a robust mutex locked from a thread of its own. A robust mutex is owned by a thread, not a
+// process: held by a user thread it is handed on with EOWNERDEAD as soon as that thread exits,
+// while the process may well go on. The holder thread lives until Release, or dies with the process.
+class LockHolder
+{
+public:
+    LockHolder() = default;
+    LockHolder(const LockHolder &that) = delete;
+    LockHolder &operator=(const LockHolder &that) = delete;
+    ~LockHolder();
+
+    // Lock mtx from the holder thread, blocking until it is acquired. mtx must outlive Release.
+    bool Acquire(Mutex &mtx);
+    // Unlock the held mutex from the holder thread, a no-op if none is held
+    void Release();
+
+private:
+    // Body of the holder thread
+    void Hold(Mutex *mtx);
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool done_ = false;
+    bool locked_ = false;
+    bool release_ = false;
 };
 
+// Futex sequence instead of pthread_cond_t: glibc condvars track their waiters, and a waiter killed
+// inside pthread_cond_wait blocks every later broadcast for good. Waiters are counted only to skip
+// the wake-up syscall, a dead one merely costs a spurious FUTEX_WAKE.
 class ConditionVar
 {
 public:
     bool Open();
     bool Close();
+    // Wait for a notification, at most tm ms. Spurious wake-ups are possible, recheck the condition.
     bool Wait(Mutex &mtx, std::size_t tm);
     bool Notify();
     bool Broadcast();
 
+    // Notification count. Read it before checking a condition that WaitAny then waits for.
+    std::uint32_t Sequence() const;
+    // Wait until any of count condition variables was notified since its seqs value, at most tm ms,
+    // without holding their mutexes. False on timeout. Without futex_waitv (Linux 5.16) it waits on
+    // the first one only, in turns of at most 1 ms.
+    static bool WaitAny(ConditionVar *const *conds, const std::uint32_t *seqs, std::size_t count, std::size_t tm);
+
 private:
-    pthread_cond_t cond_ = PTHREAD_COND_INITIALIZER;
-};
+    bool Wake(int count);
 
-inline static bool CalcWaitTime(timespec &ts, std::size_t tm /*ms*/)
-{
-    timeval now;
-    int eno = gettimeofday(&now, NULL);
-    if (eno != 0)
-    {
-        printf("fail gettimeofday [%d]\n", eno);
-        return false;
-    }
-    ts.tv_nsec = (now.tv_usec + (tm % 1000) * 1000) * 1000;
-    ts.tv_sec = now.tv_sec + (tm / 1000) + (ts.tv_nsec / 1000000000);
-    ts.tv_nsec %= 1000000000;
-    return true;
-}
+    std::atomic<std::uint32_t> seq_{0};
+    std::atomic<std::uint32_t> waiters_{0};
+};
 
 #endif
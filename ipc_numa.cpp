@@ -0,0 +1,83 @@
+#include "ipc_numa.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include <cstdint>
+
+#include "ipc_trace.h"
+
+namespace
+{
+    // From <numaif.h>, kept here to avoid a libnuma dependency
+    constexpr int mpol_bind = 2;
+    constexpr unsigned mpol_mf_move = 1 << 1;
+    constexpr int max_nodes = 64;
+
+} // internal-linkage
+
+namespace ipc
+{
+    namespace numa
+    {
+        int CurrentNode()
+        {
+            unsigned cpu = 0, node = 0;
+            if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+            {
+                return -1;
+            }
+            return static_cast<int>(node);
+        }
+
+        int CurrentCpu()
+        {
+            return sched_getcpu();
+        }
+
+        int NodeCount()
+        {
+            int cnt = 0;
+            for (int node = 0; node < max_nodes; ++node)
+            {
+                char path[64];
+                snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", node);
+                if (access(path, F_OK) == 0)
+                {
+                    cnt = node + 1;
+                }
+            }
+            return cnt == 0 ? 1 : cnt;
+        }
+
+        bool BindNode(void *mem, std::size_t size, int node)
+        {
+            if (node == any_node)
+            {
+                return true;
+            }
+            if (node == local_node)
+            {
+                node = CurrentNode();
+            }
+            if (node < 0 || node >= max_nodes)
+            {
+                IPC_LOG_ERROR("fail BindNode: invalid node = %d", node);
+                return false;
+            }
+            // mbind works on whole pages, mmap-ed memory starts page aligned
+            std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+            std::size_t len = (size + page - 1) / page * page;
+            unsigned long mask = 1ul << node;
+            if (syscall(SYS_mbind, mem, len, mpol_bind, &mask, max_nodes + 1, mpol_mf_move) != 0)
+            {
+                IPC_LOG_ERROR("fail mbind[%d]: node = %d, size = %zd", errno, node, len);
+                return false;
+            }
+            return true;
+        }
+    } // namespace numa
+} // namespace ipc
@@ -0,0 +1,27 @@
+#ifndef IPC_NUMA_H
+#define IPC_NUMA_H
+
+#include <cstddef>
+
+namespace ipc
+{
+    namespace numa
+    {
+        enum : int
+        {
+            any_node = -2,  // leave placement to the first touch
+            local_node = -1 // the node the calling thread runs on
+        };
+
+        // NUMA node / CPU of the calling thread, -1 if unknown
+        int CurrentNode();
+        int CurrentCpu();
+        // Number of possible nodes on this host
+        int NodeCount();
+        // Bind the pages of a shared mapping to a node, migrating pages already touched.
+        // local_node resolves to the node of the calling thread, any_node is a no-op.
+        bool BindNode(void *mem, std::size_t size, int node);
+    } // namespace numa
+} // namespace ipc
+
+#endif
@@ -0,0 +1,43 @@
+#include "ipc_sched.h"
+
+#include <pthread.h>
+
+#include "ipc_trace.h"
+
+namespace ipc
+{
+    namespace sched
+    {
+        bool PinThread(int cpu)
+        {
+            if (cpu < 0 || cpu >= CPU_SETSIZE)
+            {
+                IPC_LOG_ERROR("fail PinThread: invalid cpu = %d", cpu);
+                return false;
+            }
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            int eno;
+            if ((eno = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+            {
+                IPC_LOG_ERROR("fail pthread_setaffinity_np[%d]: cpu = %d", eno, cpu);
+                return false;
+            }
+            return true;
+        }
+
+        bool SetPolicy(int policy, int priority)
+        {
+            sched_param param;
+            param.sched_priority = priority;
+            int eno;
+            if ((eno = pthread_setschedparam(pthread_self(), policy, &param)) != 0)
+            {
+                IPC_LOG_ERROR("fail pthread_setschedparam[%d]: policy = %d, priority = %d", eno, policy, priority);
+                return false;
+            }
+            return true;
+        }
+    } // namespace sched
+} // namespace ipc
@@ -0,0 +1,17 @@
+#ifndef IPC_SCHED_H
+#define IPC_SCHED_H
+
+#include <sched.h>
+
+namespace ipc
+{
+    namespace sched
+    {
+        // Pin the calling thread to a single CPU
+        bool PinThread(int cpu);
+        // Switch the calling thread to a scheduling policy, e.g. SCHED_FIFO with priority 1..99
+        bool SetPolicy(int policy, int priority);
+    } // namespace sched
+} // namespace ipc
+
+#endif
@@ -0,0 +1,188 @@
+#include "ipc_trace.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace
+{
+    // Records per thread, must be a power of two
+    constexpr std::size_t buffer_size = 4096;
+
+    // Single producer (the owning thread), single consumer (the drainer) ring
+    struct ThreadBuffer
+    {
+        std::atomic<std::uint64_t> head{0};
+        std::atomic<std::uint64_t> tail{0};
+        std::uint32_t tid = 0;
+        // Cleared when the owning thread exits, the buffer is reused once drained
+        std::atomic<bool> in_use{true};
+        ipc::trace::Record records[buffer_size];
+    };
+
+    // Hands the buffer back when its thread exits
+    struct BufferOwner
+    {
+        ThreadBuffer *buf = nullptr;
+
+        ~BufferOwner()
+        {
+            if (buf != nullptr)
+            {
+                buf->in_use.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    // Buffers are never freed, so the drainer can read the events of threads that have exited.
+    // A new thread takes over a drained buffer of an exited one, so their number stays bounded
+    // by the threads alive at once, plus those whose events were not drained yet.
+    std::mutex registry_mutex;
+    std::vector<ThreadBuffer *> registry;
+    std::atomic<std::uint64_t> dropped{0};
+    std::atomic<ipc::trace::LogSink> log_sink{nullptr};
+
+    const char *const event_names[ipc::trace::event_count] = {
+        "lock_wait",
+        "wake_up",
+        "overwrite",
+        "reconnect",
+        "publish",
+        "remap",
+        "take_over",
+    };
+
+    const char *const level_names[IPC_LEVEL_OFF] = {"trace", "debug", "info", "warn", "error"};
+
+    // Under registry_mutex, so a buffer is not drained while it changes hands
+    ThreadBuffer *TakeBuffer()
+    {
+        for (ThreadBuffer *buf : registry)
+        {
+            if (!buf->in_use.load(std::memory_order_acquire) &&
+                buf->head.load(std::memory_order_relaxed) == buf->tail.load(std::memory_order_relaxed))
+            {
+                buf->in_use.store(true, std::memory_order_relaxed);
+                return buf;
+            }
+        }
+        ThreadBuffer *buf = new ThreadBuffer();
+        registry.push_back(buf);
+        return buf;
+    }
+
+    ThreadBuffer *LocalBuffer()
+    {
+        static thread_local BufferOwner owner;
+        if (owner.buf == nullptr)
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            owner.buf = TakeBuffer();
+            owner.buf->tid = static_cast<std::uint32_t>(syscall(SYS_gettid));
+        }
+        return owner.buf;
+    }
+
+    void PrintRecord(const ipc::trace::Record &rec, void *ctx)
+    {
+        fprintf(static_cast<FILE *>(ctx), "%llu %u %s %llu %llu\n",
+                static_cast<unsigned long long>(rec.ns), rec.tid, ipc::trace::EventName(rec.event),
+                static_cast<unsigned long long>(rec.a), static_cast<unsigned long long>(rec.b));
+    }
+
+} // internal-linkage
+
+namespace ipc
+{
+    namespace trace
+    {
+        void SetLogSink(LogSink sink)
+        {
+            log_sink.store(sink, std::memory_order_release);
+        }
+
+        void Log(int level, const char *fmt, ...)
+        {
+            char msg[512];
+            va_list args;
+            va_start(args, fmt);
+            vsnprintf(msg, sizeof(msg), fmt, args);
+            va_end(args);
+
+            LogSink sink = log_sink.load(std::memory_order_acquire);
+            if (sink != nullptr)
+            {
+                sink(level, msg);
+                return;
+            }
+            if (level < IPC_LEVEL_TRACE || level >= IPC_LEVEL_OFF)
+            {
+                level = IPC_LEVEL_ERROR;
+            }
+            fprintf(stderr, "[%s] %s\n", level_names[level], msg);
+        }
+
+        void Emit(Event ev, std::uint64_t a, std::uint64_t b)
+        {
+            ThreadBuffer *buf = LocalBuffer();
+            std::uint64_t head = buf->head.load(std::memory_order_relaxed);
+            if (head - buf->tail.load(std::memory_order_acquire) >= buffer_size)
+            {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            Record &rec = buf->records[head & (buffer_size - 1)];
+            rec.ns = NowNs();
+            rec.tid = buf->tid;
+            rec.event = ev;
+            rec.reserved = 0;
+            rec.a = a;
+            rec.b = b;
+            buf->head.store(head + 1, std::memory_order_release);
+        }
+
+        std::size_t Drain(Drainer fn, void *ctx)
+        {
+            std::size_t cnt = 0;
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            for (ThreadBuffer *buf : registry)
+            {
+                std::uint64_t tail = buf->tail.load(std::memory_order_relaxed);
+                std::uint64_t head = buf->head.load(std::memory_order_acquire);
+                for (; tail != head; ++tail, ++cnt)
+                {
+                    fn(buf->records[tail & (buffer_size - 1)], ctx);
+                }
+                buf->tail.store(tail, std::memory_order_release);
+            }
+            return cnt;
+        }
+
+        std::size_t Dump(FILE *fp)
+        {
+            return Drain(PrintRecord, fp);
+        }
+
+        std::uint64_t Dropped()
+        {
+            return dropped.load(std::memory_order_relaxed);
+        }
+
+        const char *EventName(std::uint16_t ev)
+        {
+            return ev < event_count ? event_names[ev] : "unknown";
+        }
+
+        std::uint64_t NowNs()
+        {
+            timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<std::uint64_t>(ts.tv_nsec);
+        }
+    } // namespace trace
+} // namespace ipc
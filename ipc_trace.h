@@ -0,0 +1,102 @@
+#ifndef IPC_TRACE_H
+#define IPC_TRACE_H
+
+#include <stdio.h>
+
+#include <cstddef>
+#include <cstdint>
+
+// Log levels, everything below IPC_LOG_LEVEL is compiled out
+#define IPC_LEVEL_TRACE 0
+#define IPC_LEVEL_DEBUG 1
+#define IPC_LEVEL_INFO 2
+#define IPC_LEVEL_WARN 3
+#define IPC_LEVEL_ERROR 4
+#define IPC_LEVEL_OFF 5
+
+#ifndef IPC_LOG_LEVEL
+#define IPC_LOG_LEVEL IPC_LEVEL_INFO
+#endif
+
+namespace ipc
+{
+    namespace trace
+    {
+        // Structured events recorded on the hot path
+        enum Event : std::uint16_t
+        {
+            lock_wait, // a: waited ns
+            wake_up,   // a: connection id, b: read index
+            overwrite, // a: readers that missed the slot, b: write index
+            reconnect, // a: connection id, b: read index
+            publish,   // a: write index, b: heartbeat
+            remap,     // a: connection id, b: generation
+            take_over, // a: writer pid
+            event_count
+        };
+
+        // Fixed-size binary record, formatted only when drained
+        struct Record
+        {
+            std::uint64_t ns;
+            std::uint32_t tid;
+            std::uint16_t event;
+            std::uint16_t reserved;
+            std::uint64_t a;
+            std::uint64_t b;
+        };
+
+        using LogSink = void (*)(int level, const char *msg);
+        using Drainer = void (*)(const Record &rec, void *ctx);
+
+        // Replace the text log output, nullptr restores the default sink (stderr)
+        void SetLogSink(LogSink sink);
+        void Log(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+        // Append an event to the lock-free buffer of the calling thread, dropped if full
+        void Emit(Event ev, std::uint64_t a, std::uint64_t b);
+        // Hand the pending events of all threads to fn, off the hot path. Returns the count.
+        std::size_t Drain(Drainer fn, void *ctx);
+        // Drain as text lines "ns tid event a b", ready to be turned into a timeline
+        std::size_t Dump(FILE *fp);
+        // Events lost because a thread buffer was full
+        std::uint64_t Dropped();
+
+        const char *EventName(std::uint16_t ev);
+        std::uint64_t NowNs();
+    } // namespace trace
+} // namespace ipc
+
+#if IPC_LOG_LEVEL <= IPC_LEVEL_TRACE
+#define IPC_TRACE(ev, a, b) ::ipc::trace::Emit(::ipc::trace::ev, (a), (b))
+#define IPC_TRACE_CLOCK(var) std::uint64_t var = ::ipc::trace::NowNs()
+#else
+#define IPC_TRACE(ev, a, b) ((void)0)
+#define IPC_TRACE_CLOCK(var)
+#endif
+
+#if IPC_LOG_LEVEL <= IPC_LEVEL_DEBUG
+#define IPC_LOG_DEBUG(...) ::ipc::trace::Log(IPC_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define IPC_LOG_DEBUG(...) ((void)0)
+#endif
+
+#if IPC_LOG_LEVEL <= IPC_LEVEL_INFO
+#define IPC_LOG_INFO(...) ::ipc::trace::Log(IPC_LEVEL_INFO, __VA_ARGS__)
+#else
+#define IPC_LOG_INFO(...) ((void)0)
+#endif
+
+#if IPC_LOG_LEVEL <= IPC_LEVEL_WARN
+#define IPC_LOG_WARN(...) ::ipc::trace::Log(IPC_LEVEL_WARN, __VA_ARGS__)
+#else
+#define IPC_LOG_WARN(...) ((void)0)
+#endif
+
+#if IPC_LOG_LEVEL <= IPC_LEVEL_ERROR
+#define IPC_LOG_ERROR(...) ::ipc::trace::Log(IPC_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define IPC_LOG_ERROR(...) ((void)0)
+#endif
+
+#endif
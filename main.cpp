@@ -1,15 +1,27 @@
 #include <iostream>
 #include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <atomic>
+#include <cstring>
+#include <limits>
+#include <memory>
 #include <thread>
 
 #include "msg_recv.hpp"
 #include "msg_send.hpp"
+#include "ipc_copy.h"
+#include "shm_linux.h"
+#include "stress.h"
 
 const std::string name = "imu_msg";
 constexpr char const mode_s__[] = "s";
 constexpr char const mode_r__[] = "r";
+constexpr char const mode_b__[] = "b";
+constexpr char const mode_k__[] = "k";
+constexpr char const mode_c__[] = "c";
+constexpr char const mode_p__[] = "p";
 std::chrono::milliseconds dura(500);
 std::chrono::milliseconds dura2(100);
 
@@ -32,9 +44,16 @@ struct Data
 
 MsgSend<Data, 10> *msg_send = nullptr;
 
-void DoSend()
+void DoSend(bool standby)
 {
-    msg_send = new MsgSend<Data, 10>(name);
+    MsgOptions opts;
+    opts.standby = standby;
+    msg_send = new MsgSend<Data, 10>(name, opts);
+    if (standby)
+    {
+        std::cout << __func__ << ": standby\n";
+        msg_send->TakeOver();
+    }
 
     std::cout << __func__ << ": start\n";
     Data a;
@@ -75,11 +94,209 @@ void DoRecv()
     }
 }
 
+// GB/s of copying size bytes into / out of a ring of 16 slots, as a channel does
+template <std::size_t Size>
+struct CopyData
+{
+    char body[Size];
+};
+
+// Progress of the reader process of the copy benchmark, in a shared anonymous mapping
+struct CopyProgress
+{
+    std::atomic<bool> ready;
+    std::atomic<std::uint64_t> received;
+};
+
+// Ring of the copy benchmark, twice the last-level cache so slots are read from memory as in a
+// real channel, not from a cache the writer just filled
+std::size_t CopyRingBytes()
+{
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    return 2 * (llc > 0 ? static_cast<std::size_t>(llc) : std::size_t{32} << 20);
+}
+
+// GB/s from a writer to a reader process, with the given copy and prefetch thresholds.
+// The writer stays less than a ring behind the reader, so no message is lost; the first lap faults
+// the ring in and is not timed.
+template <std::size_t Size>
+double ChannelCopyRate(std::size_t threshold, std::size_t prefetch, CopyProgress *progress)
+{
+    using Data = CopyData<Size>;
+    const std::size_t capacity = std::max<std::size_t>(CopyRingBytes() / Size, 16);
+    const std::size_t laps = 1;
+    const std::uint64_t count = capacity * (laps + 1);
+    ipc::copy::SetThreshold(threshold);
+    ipc::copy::SetPrefetchThreshold(prefetch);
+    progress->ready = false;
+    progress->received = 0;
+
+    MsgOptions opts;
+    opts.capacity = capacity;
+    opts.intra_process = false;
+    std::unique_ptr<MsgSend<Data, 16>> msg_send(new MsgSend<Data, 16>("copy_bench", opts));
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        MsgRecv<Data> msg_recv("copy_bench", opts);
+        std::unique_ptr<Data> data(new Data());
+        msg_recv.Get(*data, 0);
+        progress->ready = true;
+        while (progress->received < count && msg_recv.Get(*data, 1000))
+        {
+            progress->received++;
+        }
+        _exit(0);
+    }
+    while (!progress->ready)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    std::unique_ptr<Data> data(new Data());
+    memset(data->body, 1, Size);
+    std::chrono::steady_clock::time_point start;
+    for (std::uint64_t i = 0; i < count; ++i)
+    {
+        if (i == capacity)
+        {
+            start = std::chrono::steady_clock::now();
+        }
+        while (i - progress->received >= capacity - 1)
+        {
+            std::this_thread::yield();
+        }
+        msg_send->Pub(*data);
+    }
+    while (progress->received < count && waitpid(pid, nullptr, WNOHANG) == 0)
+    {
+        std::this_thread::yield();
+    }
+    std::chrono::duration<double> sec = std::chrono::steady_clock::now() - start;
+    waitpid(pid, nullptr, 0);
+    return progress->received == count ? capacity * laps * Size / sec.count() / 1e9 : 0;
+}
+
+template <std::size_t Size>
+void CopyBenchRow(CopyProgress *progress)
+{
+    constexpr std::size_t off = std::numeric_limits<std::size_t>::max();
+    std::cout << Size << "\t" << ChannelCopyRate<Size>(off, off, progress) << "\t" << ChannelCopyRate<Size>(off, 0, progress)
+              << "\t" << ChannelCopyRate<Size>(0, 0, progress) << std::endl;
+}
+
+// Compare memcpy, memcpy with prefetching and the copy engine between two processes, to pick
+// IPC_COPY_THRESHOLD and IPC_PREFETCH_THRESHOLD
+void DoCopyBench()
+{
+    void *mem = mmap(nullptr, sizeof(CopyProgress), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        return;
+    }
+    auto progress = new (mem) CopyProgress();
+    std::cout << "engine: " << ipc::copy::Engine() << ", threshold: " << ipc::copy::Threshold()
+              << ", prefetch threshold: " << ipc::copy::PrefetchThreshold() << ", ring: " << (CopyRingBytes() >> 20)
+              << " MiB\n";
+    std::cout << "size\tmemcpy\tprefetch\tengine (GB/s)\n";
+    CopyBenchRow<4 << 10>(progress);
+    CopyBenchRow<16 << 10>(progress);
+    CopyBenchRow<64 << 10>(progress);
+    CopyBenchRow<256 << 10>(progress);
+    CopyBenchRow<1 << 20>(progress);
+    CopyBenchRow<4 << 20>(progress);
+    munmap(mem, sizeof(CopyProgress));
+}
+
+// Payload of the channel setup benchmark, a 1 MiB segment with a ring of 16
+struct PoolData
+{
+    char body[64 << 10];
+};
+
+// Microseconds to create a channel, fill its ring once and tear it down
+double ChannelSetupUs(std::size_t rounds)
+{
+    PoolData data{};
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < rounds; ++i)
+    {
+        MsgSend<PoolData, 16> msg_send("pool_bench");
+        for (std::size_t j = 0; j < 16; ++j)
+        {
+            msg_send.Pub(data);
+        }
+    }
+    std::chrono::duration<double, std::micro> us = std::chrono::steady_clock::now() - start;
+    return us.count() / rounds;
+}
+
+// Reader process following the benchmark channel from one writer to the next, killed by the caller
+pid_t SpawnPoolReader()
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        MsgRecv<PoolData> msg_recv("pool_bench");
+        PoolData data;
+        for (;;)
+        {
+            msg_recv.Get(data, 10);
+        }
+    }
+    // Let it attach to the first channel
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    return pid;
+}
+
+// Compare channel setup on fresh segments with segments checked out of the ipc::shm pool
+void DoPoolBench()
+{
+    constexpr std::size_t rounds = 200;
+    std::cout << "fresh: " << ChannelSetupUs(rounds) << " us" << std::endl;
+    // Segments come back on the last release, a few are enough for a sequence of channels
+    ipc::shm::pool_reserve(GetTotalSize(16, sizeof(Item<PoolData>)), 2);
+    std::cout << "pooled: " << ChannelSetupUs(rounds) << " us" << std::endl;
+    // A segment the reader still maps at teardown is reused once the reader moved on
+    pid_t reader = SpawnPoolReader();
+    std::cout << "pooled, reader attached: " << ChannelSetupUs(rounds) << " us" << std::endl;
+    kill(reader, SIGKILL);
+    waitpid(reader, nullptr, 0);
+    ipc::shm::pool_clear();
+}
+
 int main(int argc, char **argv)
 {
     if (argc < 2)
         return 0;
 
+    // Crash stress: test k [seconds] [readers] [max_recovery_ms]
+    if (std::string{argv[1]} == mode_k__)
+    {
+        StressOptions opts;
+        if (argc > 2)
+            opts.seconds = std::stoul(argv[2]);
+        if (argc > 3)
+            opts.readers = std::stoul(argv[3]);
+        if (argc > 4)
+            opts.max_recovery_ms = std::stoul(argv[4]);
+        return RunStress(opts);
+    }
+
+    // Copy engine benchmark: test c
+    if (std::string{argv[1]} == mode_c__)
+    {
+        DoCopyBench();
+        return 0;
+    }
+
+    // Channel setup benchmark: test p
+    if (std::string{argv[1]} == mode_p__)
+    {
+        DoPoolBench();
+        return 0;
+    }
+
     auto exit = [](int)
     {
         is_quit__.store(true, std::memory_order_release);
@@ -98,7 +315,11 @@ int main(int argc, char **argv)
     std::thread send, recv;
     if (std::string{argv[1]} == mode_s__)
     {
-        send = std::thread{DoSend};
+        send = std::thread{DoSend, false};
+    }
+    else if (std::string{argv[1]} == mode_b__)
+    {
+        send = std::thread{DoSend, true};
     }
     else if (std::string{argv[1]} == mode_r__)
     {
@@ -6,17 +6,21 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <type_traits>
 #include <atomic>
+#include <chrono>
 #include <string>
 #include <utility>
 #include <cstring>
 #include <iostream>
 
 #include "ipc_lock.h"
+#include "ipc_numa.h"
+#include "ipc_sched.h"
 
 // Reside in user process memory
 struct MsgInfo
@@ -29,6 +33,161 @@ struct MsgInfo
     size_t type;
 };
 
+enum : std::size_t
+{
+    // Priority lanes a channel can hold
+    max_lanes = 4,
+    // Readers one consumer group can hold
+    max_group_members = 16
+};
+
+// Channel settings chosen when a writer creates or a reader attaches to a channel
+struct MsgOptions
+{
+    // Ring depth, 0 to use the compile-time default of the writer
+    std::size_t capacity = 0;
+    // Priority lanes of a new channel, each a ring of capacity items. Lane 0 is drained first.
+    std::size_t lanes = 1;
+    // Reader side: after this many reads from a higher lane while a lower one has messages
+    // pending, serve one from the lower lane. 0 for strict priority.
+    std::size_t starve_limit = 0;
+    // Do not create the channel, wait in TakeOver until the active writer dies
+    bool standby = false;
+    // Node the writer binds the segment to, see ipc::numa
+    int numa_node = ipc::numa::any_node;
+    // Key range a reader subscribes to, the writer only flags and wakes it for keyed
+    // messages inside the range. The full range means no filter.
+    std::uint64_t key_lo = 0;
+    std::uint64_t key_hi = (std::numeric_limits<std::uint64_t>::max)();
+    // Name of a consumer group. Readers of one group share a connection id and claim
+    // every message exactly once between them instead of each getting a copy.
+    std::string group;
+    // Create the segment with memfd_create and hand it to readers over a Unix socket
+    // instead of a world-accessible name under /dev/shm. Set on both ends.
+    bool anonymous = false;
+    // Priority-inheritance header mutex, so a low-priority reader cannot stall a real-time one
+    bool prio_inherit = false;
+    // Reader side: on attach, replay the last replay messages still in the rings
+    std::size_t replay = 0;
+    // Reader side: on attach, replay the messages still in the rings from this sequence number on,
+    // e.g. MsgRecv::LastSeq() + 1 of a previous run. Overrides replay, 0 for none.
+    std::uint64_t since_seq = 0;
+    // Serve readers in the writer's process from in-process queues holding one shared immutable
+    // copy, and skip the segment while no other process reads. Set on both ends, capacity of a
+    // reader is its queue depth. Not used with several lanes, consumer groups or replay.
+    bool intra_process = true;
+
+    // Placement applied by ApplyThreadOptions, -1 / 0 to leave unchanged. The constructors do not
+    // apply it: the thread that publishes or reads calls ApplyThreadOptions itself.
+    int cpu = -1;
+    int sched_policy = SCHED_FIFO;
+    int sched_priority = 0;
+};
+
+// Apply the thread placement of the options to the calling thread, e.g. first thing in the
+// thread that publishes to or reads from a channel
+inline void ApplyThreadOptions(const MsgOptions &opts)
+{
+    if (opts.cpu >= 0)
+    {
+        ipc::sched::PinThread(opts.cpu);
+    }
+    if (opts.sched_priority > 0)
+    {
+        ipc::sched::SetPolicy(opts.sched_policy, opts.sched_priority);
+    }
+}
+
+// Message stamp: CLOCK_MONOTONIC in ns, comparable between processes on one host
+inline std::uint64_t StampNow()
+{
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                          std::chrono::steady_clock::now().time_since_epoch())
+                                          .count());
+}
+
+// FNV-1a, stable across processes unlike std::hash. Never 0 for a non-empty name.
+inline std::uint64_t HashName(const std::string &name)
+{
+    if (name.empty())
+    {
+        return 0;
+    }
+    std::uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : name)
+    {
+        h = (h ^ c) * 1099511628211ull;
+    }
+    return h == 0 ? 1 : h;
+}
+
+// Where a connected reader runs, reported in the shared header
+struct ReaderInfo
+{
+    std::uint32_t conn_id = 0;
+    pid_t pid = 0;
+    int cpu = -1;
+    int node = -1;
+};
+
+// Per-connection state the writer consults when flagging and waking readers
+struct ReaderSlot
+{
+    std::uint64_t key_lo = 0;
+    std::uint64_t key_hi = 0;
+    // Hash of the consumer group sharing this connection, 0 for a single reader
+    std::uint64_t group = 0;
+    std::uint32_t members = 0;
+    // Process of each group member, 0 for a free entry, so that killed members can be counted out
+    pid_t member_pids[max_group_members] = {};
+    // Targeted readers wait here instead of on the shared cond_not_empty
+    ConditionVar cond_ready;
+
+    // Count a group member in, false if the group is full
+    bool AddMember(pid_t pid)
+    {
+        for (pid_t &member : member_pids)
+        {
+            if (member == 0)
+            {
+                member = pid;
+                members++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void RemoveMember(pid_t pid)
+    {
+        for (pid_t &member : member_pids)
+        {
+            if (member == pid)
+            {
+                member = 0;
+                members--;
+                return;
+            }
+        }
+    }
+
+    // Count out the members of processes that died without disconnecting, returns how many
+    std::uint32_t ReapMembers()
+    {
+        std::uint32_t reaped = 0;
+        for (pid_t &member : member_pids)
+        {
+            if (member > 0 && kill(member, 0) != 0 && errno == ESRCH)
+            {
+                member = 0;
+                members--;
+                reaped++;
+            }
+        }
+        return reaped;
+    }
+};
+
 // TODO: lock-free implementation
 class HeaderConn
 {
@@ -43,14 +202,15 @@ public:
         // find the first 0, and set it to 1.
         std::uint32_t next = curr_mask_ | (curr_mask_ + 1);
         std::uint32_t connected_id = next ^ curr_mask_;
-        curr_mask_ = next;
+        __atomic_store_n(&curr_mask_, next, __ATOMIC_RELEASE);
         return connected_id;
     }
 
     // Return the mask after removing the disconnected id
     std::uint32_t DisconnectId(std::uint32_t id)
     {
-        curr_mask_ = (curr_mask_ & ~id) & ~id;
+        // Released, so CurConnUnlocked seeing the id gone also sees what preceded the disconnect
+        __atomic_store_n(&curr_mask_, (curr_mask_ & ~id) & ~id, __ATOMIC_RELEASE);
         return curr_mask_;
     }
 
@@ -58,9 +218,9 @@ public:
     {
         std::uint32_t mask = curr_mask_;
         std::uint32_t cnt;
-        for (cnt = 0; curr_mask_; ++cnt)
+        for (cnt = 0; mask; ++cnt)
         {
-            curr_mask_ &= curr_mask_ - 1;
+            mask &= mask - 1;
         }
 
         return cnt;
@@ -71,6 +231,12 @@ public:
         return curr_mask_;
     }
 
+    // CurConn without holding the mutex, changes are stored with it held
+    std::uint32_t CurConnUnlocked() const
+    {
+        return __atomic_load_n(&curr_mask_, __ATOMIC_ACQUIRE);
+    }
+
     bool IsConnected(std::uint32_t rid)
     {
         return ((curr_mask_ | ~rid) & rid) != 0;
@@ -88,18 +254,48 @@ struct alignas(64) MsgHeader
     Mutex mutex;
     ConditionVar cond_not_empty;
 
-    // Internal circular buffer
+    // Held by the active writer for its whole life, from a holder thread of its own, a standby writer
+    // blocks on it and gets EOWNERDEAD the moment the active writer process dies.
+    Mutex owner;
+    pid_t writer_pid = 0;
+    // Bumped by the active writer on every publish
+    std::atomic<std::uint64_t> heartbeat = ATOMIC_VAR_INIT(0);
+    // Sequence number of the last message, over all lanes. Atomic, messages only readers of the
+    // writer's process get are numbered without the mutex.
+    std::atomic<std::uint64_t> seq = ATOMIC_VAR_INIT(0);
+
+    // Set when the writer migrated to a larger segment under the same name
+    std::atomic_bool resized = ATOMIC_VAR_INIT(false);
+    // Bumped on every migration, so readers can tell they followed the right segment
+    std::uint32_t generation = 0;
+
+    // Internal circular buffers, one per priority lane
     std::size_t capacity;
     std::size_t size;
-    std::size_t wi = 0; // TODO: not thread-safe
-    size_t type_hash;
+    std::size_t lanes = 1;
+    std::size_t wi[max_lanes] = {}; // TODO: not thread-safe
+    // Stored last, with release: a reader seeing it set finds the whole header initialized
+    std::atomic<std::size_t> type_hash{0};
 
     // Connected readers
     HeaderConn conn;
+    // Locality of the connected readers, indexed by the bit of their connection id
+    ReaderInfo readers[32];
+    // Readers only woken up for messages flagged for them, see ReaderSlot
+    std::uint32_t targeted_mask = 0;
+    // Readers that lost an unread slot to the writer, per lane. They resume at the oldest slot.
+    std::uint32_t lapped[max_lanes] = {};
+    ReaderSlot slots[32];
 
-    bool IsEqualWi(std::size_t ri)
+    bool IsEqualWi(std::size_t ri, std::size_t lane = 0)
     {
-        return ri % capacity == wi;
+        return ri % capacity == wi[lane];
+    }
+
+    // Position of a slot of a lane in the item array
+    std::size_t Index(std::size_t lane, std::size_t i)
+    {
+        return lane * capacity + i;
     }
 
     std::size_t IncRi(std::size_t &ri)
@@ -107,6 +303,113 @@ struct alignas(64) MsgHeader
         ri = (ri + 1) % capacity;
         return ri;
     }
+
+    ReaderInfo &Reader(std::uint32_t conn_id)
+    {
+        return readers[__builtin_ctz(conn_id)];
+    }
+
+    ReaderSlot &Slot(std::uint32_t conn_id)
+    {
+        return slots[__builtin_ctz(conn_id)];
+    }
+
+    // Reader flags of a keyed message: all untargeted readers plus the targeted ones whose range holds key
+    std::uint32_t MatchKey(std::uint64_t key)
+    {
+        std::uint32_t rc = ~targeted_mask;
+        for (std::uint32_t mask = targeted_mask & conn.CurConn(); mask != 0; mask &= mask - 1)
+        {
+            std::uint32_t id = mask & ~(mask - 1);
+            if (key >= Slot(id).key_lo && key <= Slot(id).key_hi)
+            {
+                rc |= id;
+            }
+        }
+        return rc;
+    }
+
+    // Wake up the connected readers flagged in rc
+    void Wake(std::uint32_t rc)
+    {
+        std::uint32_t cc = conn.CurConn();
+        if ((rc & cc & ~targeted_mask) != 0)
+        {
+            cond_not_empty.Broadcast();
+        }
+        for (std::uint32_t mask = rc & cc & targeted_mask; mask != 0; mask &= mask - 1)
+        {
+            ReaderSlot &slot = Slot(mask & ~(mask - 1));
+            // A single group member claims the message, do not wake up the others
+            if (slot.group != 0)
+            {
+                slot.cond_ready.Notify();
+            }
+            else
+            {
+                slot.cond_ready.Broadcast();
+            }
+        }
+    }
+
+    // Connection id of a consumer group, 0 if no member is connected
+    std::uint32_t FindGroup(std::uint64_t group)
+    {
+        for (std::uint32_t mask = targeted_mask & conn.CurConn(); mask != 0; mask &= mask - 1)
+        {
+            std::uint32_t id = mask & ~(mask - 1);
+            if (Slot(id).group == group)
+            {
+                return id;
+            }
+        }
+        return 0;
+    }
+
+    // Free the ids of readers killed without disconnecting, returns the freed ids.
+    // A consumer group counts its dead members out and frees its id once none is left.
+    std::uint32_t ReclaimDead()
+    {
+        std::uint32_t freed = 0;
+        for (std::uint32_t mask = conn.CurConn(); mask != 0; mask &= mask - 1)
+        {
+            std::uint32_t id = mask & ~(mask - 1);
+            ReaderInfo &info = Reader(id);
+            ReaderSlot &slot = Slot(id);
+            bool dead;
+            if (slot.group != 0)
+            {
+                slot.ReapMembers();
+                dead = slot.members == 0;
+            }
+            else
+            {
+                dead = info.pid > 0 && kill(info.pid, 0) != 0 && errno == ESRCH;
+            }
+            if (dead)
+            {
+                conn.DisconnectId(id);
+                targeted_mask &= ~id;
+                for (std::uint32_t &lap : lapped)
+                {
+                    lap &= ~id;
+                }
+                info = ReaderInfo();
+                freed |= id;
+            }
+        }
+        return freed;
+    }
+
+    // Wake up every reader, e.g. on shut down or migration
+    void WakeAll()
+    {
+        cond_not_empty.Broadcast();
+        for (std::uint32_t mask = targeted_mask; mask != 0; mask &= mask - 1)
+        {
+            Slot(mask & ~(mask - 1)).cond_ready.Broadcast();
+        }
+    }
 };
 
 template <typename T>
@@ -115,9 +418,15 @@ struct Item
     // Uninitialized memory blocks to hold the object
     typename std::aligned_storage<sizeof(T), alignof(T)>::type data{};
     std::uint32_t rc{0}; // Reader flags, bit 0 for being read, 1 for not read
+    bool keyed{false};
+    // Channel-wide sequence number, 0 for a slot never written
+    std::uint64_t seq{0};
+    std::uint64_t key{0};
+    // Publish time, or the stamp given by the writer, see StampNow
+    std::uint64_t stamp{0};
 };
 
-std::size_t GetTotalSize(std::size_t len, std::size_t data_size)
+inline std::size_t GetTotalSize(std::size_t len, std::size_t data_size)
 {
     return sizeof(MsgHeader) + len * data_size;
 }
@@ -0,0 +1,389 @@
+#ifndef MSG_CONFLATE_HPP
+#define MSG_CONFLATE_HPP
+
+#include "ipc_lock.h"
+#include "msg_comm.hpp"
+
+// Conflating channel for per-key state: a publish for a key replaces its pending value in place,
+// so a slow reader gets the latest value of every dirty key instead of every update.
+// Memory and reader work are bounded by the number of keys K, not by the publish rate.
+
+// Reside in shared memory header for synchronization
+struct alignas(64) ConflateHeader
+{
+    std::atomic_bool shut_down = ATOMIC_VAR_INIT(false);
+    Mutex mutex;
+    ConditionVar cond_not_empty;
+
+    // Open-addressing table of keys
+    std::size_t capacity;
+    std::size_t count = 0;
+    // Stored last, with release: a reader seeing it set finds the header initialized
+    std::atomic<std::size_t> type_hash{0};
+
+    // Connected readers
+    HeaderConn conn;
+    // Dirty keys per reader, indexed by the bit of the connection id
+    std::uint32_t pending[32];
+    // Process of each reader, to take back the ids of readers that died without releasing them
+    pid_t pids[32];
+
+    // Disconnect the readers whose process is gone, called with the mutex held.
+    // Returns the mask of the freed connection ids.
+    std::uint32_t ReclaimDead()
+    {
+        std::uint32_t freed = 0;
+        for (std::uint32_t mask = conn.CurConn(); mask != 0; mask &= mask - 1)
+        {
+            std::uint32_t id = mask & ~(mask - 1);
+            pid_t &pid = pids[__builtin_ctz(id)];
+            if (pid > 0 && kill(pid, 0) != 0 && errno == ESRCH)
+            {
+                conn.DisconnectId(id);
+                pending[__builtin_ctz(id)] = 0;
+                pid = 0;
+                freed |= id;
+            }
+        }
+        return freed;
+    }
+};
+
+template <typename T>
+struct ConflateEntry
+{
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type data{};
+    std::uint64_t key = 0;
+    bool used = false;
+    std::uint32_t dirty = 0; // Reader flags, 1 for an unread value
+};
+
+template <typename T, std::size_t K = 64>
+class ConflateSend
+{
+public:
+    using Entry = ConflateEntry<T>;
+
+    ConflateSend(const std::string &msg_name, const MsgOptions &opts = MsgOptions())
+    {
+        msg_info_.type = typeid(T).hash_code();
+        msg_info_.name = std::move(msg_name);
+        capacity_ = opts.capacity == 0 ? K : opts.capacity;
+        prio_inherit_ = opts.prio_inherit;
+        Connect();
+    }
+
+    ConflateSend() = delete;
+    ConflateSend(const ConflateSend &that) = delete;
+    ConflateSend &operator=(const ConflateSend &that) = delete;
+
+    ~ConflateSend()
+    {
+        if (!isValid_)
+        {
+            return;
+        }
+        isValid_ = false;
+        // Notify the readers
+        header_->shut_down = true;
+        header_->cond_not_empty.Broadcast();
+
+        if (munmap(msg_info_.mem, msg_info_.size) != 0)
+        {
+            IPC_LOG_ERROR("ConflateSend fail munmap[%d]: %s", errno, msg_info_.name.c_str());
+            return;
+        }
+        if (shm_unlink(msg_info_.name.c_str()) != 0)
+        {
+            IPC_LOG_ERROR("ConflateSend fail shm_unlink[%d]: %s", errno, msg_info_.name.c_str());
+            return;
+        }
+    }
+
+    bool Connect()
+    {
+        if (msg_info_.name.empty() || msg_info_.name.at(0) == '\0')
+        {
+            IPC_LOG_ERROR("ConflateSend failed: msg_name is empty");
+            return false;
+        }
+        int fd = shm_open(msg_info_.name.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+        if (fd == -1)
+        {
+            IPC_LOG_ERROR("ConflateSend fail shm_open[%d]: %s", errno, msg_info_.name.c_str());
+            return false;
+        }
+        msg_info_.size = sizeof(ConflateHeader) + capacity_ * sizeof(Entry);
+        if (ftruncate(fd, static_cast<off_t>(msg_info_.size)) != 0)
+        {
+            IPC_LOG_ERROR("ConflateSend fail ftruncate[%d]: %s, size = %zd", errno, msg_info_.name.c_str(), msg_info_.size);
+            close(fd);
+            return false;
+        }
+        void *mem = mmap(nullptr, msg_info_.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED)
+        {
+            IPC_LOG_ERROR("ConflateSend fail mmap[%d]: %s, size = %zd", errno, msg_info_.name.c_str(), msg_info_.size);
+            close(fd);
+            return false;
+        }
+        msg_info_.mem = mem;
+
+        // Initialize the contents in shared memory
+        header_ = reinterpret_cast<ConflateHeader *>(mem);
+        entries_ = reinterpret_cast<Entry *>((uint8_t *)mem + sizeof(ConflateHeader));
+        header_->capacity = capacity_;
+        header_->mutex.Open(prio_inherit_);
+        header_->cond_not_empty.Open();
+        header_->type_hash.store(msg_info_.type, std::memory_order_release);
+
+        close(fd);
+        isValid_ = true;
+        return true;
+    }
+
+    bool IsValid()
+    {
+        return isValid_;
+    }
+
+    // Replace the value of key, or add it if the table still has room
+    bool Pub(std::uint64_t key, const T &data)
+    {
+        if (!isValid_)
+        {
+            return false;
+        }
+
+        header_->mutex.Lock();
+        Entry *entry = Find(key);
+        if (entry == nullptr)
+        {
+            header_->mutex.Unlock();
+            IPC_LOG_ERROR("ConflateSend: %s full, %zd keys", msg_info_.name.c_str(), header_->capacity);
+            return false;
+        }
+        if (!entry->used)
+        {
+            entry->used = true;
+            entry->key = key;
+            header_->count++;
+        }
+        new (&entry->data) T(data);
+
+        // Count the key as pending only for readers that had consumed its previous value
+        std::uint32_t cc = header_->conn.CurConn();
+        for (std::uint32_t mask = cc & ~entry->dirty; mask != 0; mask &= mask - 1)
+        {
+            header_->pending[__builtin_ctz(mask)]++;
+        }
+        entry->dirty = 0xffffffff;
+        header_->cond_not_empty.Broadcast();
+        header_->mutex.Unlock();
+        return true;
+    }
+
+private:
+    // Entry holding key, or the free entry it goes to. nullptr if the table is full.
+    Entry *Find(std::uint64_t key)
+    {
+        std::size_t cap = header_->capacity;
+        for (std::size_t i = 0, pos = key % cap; i < cap; ++i, pos = (pos + 1) % cap)
+        {
+            if (!entries_[pos].used || entries_[pos].key == key)
+            {
+                return &entries_[pos];
+            }
+        }
+        return nullptr;
+    }
+
+    ConflateHeader *header_;
+    Entry *entries_;
+    MsgInfo msg_info_;
+    std::size_t capacity_ = K;
+    bool prio_inherit_ = false;
+
+    bool isValid_ = false;
+};
+
+template <typename T>
+class ConflateRecv
+{
+public:
+    using Entry = ConflateEntry<T>;
+
+    ConflateRecv(const std::string &msg_name, const MsgOptions &opts = MsgOptions())
+    {
+        msg_info_.type = typeid(T).hash_code();
+        msg_info_.name = std::move(msg_name);
+        Init();
+    }
+
+    ConflateRecv() = delete;
+    ConflateRecv(const ConflateRecv &that) = delete;
+    ConflateRecv &operator=(const ConflateRecv &that) = delete;
+
+    ~ConflateRecv()
+    {
+        Release();
+    }
+
+    bool Init()
+    {
+        if (msg_info_.name.empty() || msg_info_.name.at(0) == '\0')
+        {
+            IPC_LOG_ERROR("ConflateRecv failed: msg_name is empty");
+            return false;
+        }
+        int fd = shm_open(msg_info_.name.c_str(), O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+        if (fd == -1)
+        {
+            IPC_LOG_ERROR("ConflateRecv fail shm_open[%d]: %s", errno, msg_info_.name.c_str());
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) <= sizeof(ConflateHeader))
+        {
+            IPC_LOG_ERROR("ConflateRecv fail to_mem: %s", msg_info_.name.c_str());
+            close(fd);
+            return false;
+        }
+        msg_info_.size = static_cast<std::size_t>(st.st_size);
+        void *mem = mmap(nullptr, msg_info_.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED)
+        {
+            IPC_LOG_ERROR("ConflateRecv fail mmap[%d]: %s, size = %zd", errno, msg_info_.name.c_str(), msg_info_.size);
+            return false;
+        }
+        msg_info_.mem = mem;
+
+        header_ = reinterpret_cast<ConflateHeader *>(mem);
+        entries_ = reinterpret_cast<Entry *>((uint8_t *)mem + sizeof(ConflateHeader));
+        if (header_->type_hash.load(std::memory_order_acquire) != msg_info_.type || header_->shut_down)
+        {
+            Release();
+            return false;
+        }
+        isValid_ = true;
+        return true;
+    }
+
+    // Latest value of the next dirty key, waiting at most tm ms for one.
+    // Every key is returned at most once per update, however often it was published.
+    bool Get(std::uint64_t &key, T &data, std::size_t tm = 0)
+    {
+        if (!isValid_ && !Init())
+        {
+            return false;
+        }
+
+        header_->mutex.Lock();
+        if (!header_->conn.IsConnected(conn_id_) && !Connect())
+        {
+            header_->mutex.Unlock();
+            return false;
+        }
+
+        std::uint32_t &pending = header_->pending[__builtin_ctz(conn_id_)];
+        for (;;)
+        {
+            while (pending == 0)
+            {
+                if (header_->shut_down || !header_->cond_not_empty.Wait(header_->mutex, tm))
+                {
+                    header_->mutex.Unlock();
+                    if (header_->shut_down)
+                    {
+                        Release();
+                    }
+                    return false;
+                }
+            }
+
+            // Round-robin over the table, so no key is starved by a hot one
+            std::size_t cap = header_->capacity;
+            for (std::size_t i = 0; i < cap; ++i, cursor_ = (cursor_ + 1) % cap)
+            {
+                Entry &entry = entries_[cursor_];
+                if (entry.used && (entry.dirty & conn_id_))
+                {
+                    entry.dirty &= ~conn_id_;
+                    pending--;
+                    key = entry.key;
+                    data = *reinterpret_cast<T *>(&entry.data);
+                    cursor_ = (cursor_ + 1) % cap;
+                    header_->mutex.Unlock();
+                    return true;
+                }
+            }
+            // A writer killed between counting and flagging an update leaves pending too high
+            pending = 0;
+        }
+    }
+
+private:
+    // Connect and mark every known key dirty, so a new reader starts from the full state.
+    // Called with the mutex held.
+    bool Connect()
+    {
+        if (header_->conn.CurConn() + 1 == 0 && header_->ReclaimDead() == 0)
+        {
+            IPC_LOG_ERROR("ConflateRecv exceed connection limit: %zd", header_->conn.ConnCount());
+            return false;
+        }
+        conn_id_ = header_->conn.GetConnectId();
+        header_->pids[__builtin_ctz(conn_id_)] = getpid();
+        std::uint32_t cnt = 0;
+        for (std::size_t i = 0; i < header_->capacity; ++i)
+        {
+            if (entries_[i].used)
+            {
+                entries_[i].dirty |= conn_id_;
+                cnt++;
+            }
+            else
+            {
+                entries_[i].dirty &= ~conn_id_;
+            }
+        }
+        header_->pending[__builtin_ctz(conn_id_)] = cnt;
+        cursor_ = 0;
+        return true;
+    }
+
+    void Release()
+    {
+        isValid_ = false;
+        if (msg_info_.mem == nullptr || msg_info_.size == 0)
+        {
+            return;
+        }
+        // The writer may have destroyed the mutex once it shut down
+        if (conn_id_ != 0 && !header_->shut_down && header_->mutex.Lock())
+        {
+            header_->conn.DisconnectId(conn_id_);
+            header_->pids[__builtin_ctz(conn_id_)] = 0;
+            header_->mutex.Unlock();
+        }
+        if (munmap(msg_info_.mem, msg_info_.size) != 0)
+        {
+            IPC_LOG_ERROR("ConflateRecv fail munmap[%d]: %s", errno, msg_info_.name.c_str());
+        }
+        msg_info_.mem = nullptr;
+        msg_info_.size = 0;
+        conn_id_ = 0;
+    }
+
+    ConflateHeader *header_ = nullptr;
+    Entry *entries_ = nullptr;
+    MsgInfo msg_info_;
+
+    bool isValid_ = false;
+    std::uint32_t conn_id_ = 0;
+    // Next table position to scan
+    std::size_t cursor_ = 0;
+};
+
+#endif
@@ -0,0 +1,204 @@
+#ifndef MSG_LOCAL_HPP
+#define MSG_LOCAL_HPP
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ipc_lock.h"
+
+// In-process delivery between a writer and readers of the same channel in one process.
+// Messages are shared as one immutable copy: readers skip the segment, its robust mutex and the futex.
+// The writer numbers every message with the header's atomic counter, so sequence numbers and the
+// heartbeat keep counting, and takes the header mutex only while a reader of another process is
+// connected. A message no other process reads is not stored for replay.
+
+// Queue of one in-process reader. Like the ring, the oldest message is dropped when it is full.
+template <typename T>
+class LocalQueue
+{
+public:
+    LocalQueue(std::size_t depth, std::uint64_t key_lo, std::uint64_t key_hi)
+        : depth_(std::max<std::size_t>(depth, 1)), key_lo_(key_lo), key_hi_(key_hi)
+    {
+    }
+
+    void Push(const std::shared_ptr<const T> &msg, std::uint64_t seq, bool keyed, std::uint64_t key)
+    {
+        if (keyed && (key < key_lo_ || key > key_hi_))
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (queue_.size() == depth_)
+            {
+                queue_.pop_front();
+            }
+            queue_.push_back(Entry{msg, seq});
+        }
+        cond_.notify_one();
+    }
+
+    // Wait at most tm ms for a message and its sequence number, false on time out or when woken up by Wake
+    bool Pop(std::shared_ptr<const T> &msg, std::uint64_t &seq, std::size_t tm)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (queue_.empty() && tm != 0)
+        {
+            std::uint64_t wakes = wakes_;
+            auto ready = [this, wakes]
+            { return !queue_.empty() || wakes_ != wakes; };
+            if (tm == invalid_value)
+            {
+                cond_.wait(lock, ready);
+            }
+            else
+            {
+                cond_.wait_for(lock, std::chrono::milliseconds(tm), ready);
+            }
+        }
+        if (queue_.empty())
+        {
+            return false;
+        }
+        msg = std::move(queue_.front().msg);
+        seq = queue_.front().seq;
+        queue_.pop_front();
+        return true;
+    }
+
+    // Release a waiting reader, e.g. when the writer goes away
+    void Wake()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            wakes_++;
+        }
+        cond_.notify_all();
+    }
+
+private:
+    struct Entry
+    {
+        std::shared_ptr<const T> msg;
+        std::uint64_t seq;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<Entry> queue_;
+    std::uint64_t wakes_ = 0;
+    std::size_t depth_;
+    std::uint64_t key_lo_;
+    std::uint64_t key_hi_;
+};
+
+// Writers and readers of one channel name within this process
+template <typename T>
+class LocalTopic
+{
+public:
+    // The topic of name, shared by everyone in the process using it with the same type.
+    // A forked child does not inherit the writers and readers of its parent.
+    static std::shared_ptr<LocalTopic> Get(const std::string &name)
+    {
+        static std::mutex registry_mutex;
+        static std::map<std::string, std::weak_ptr<LocalTopic>> registry;
+
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        std::shared_ptr<LocalTopic> topic = registry[name].lock();
+        if (!topic || topic->pid_ != getpid())
+        {
+            topic = std::make_shared<LocalTopic>();
+            registry[name] = topic;
+        }
+        return topic;
+    }
+
+    // depth: ring depth of the writer, the default queue depth of the readers
+    void AddWriter(std::size_t depth)
+    {
+        depth_ = depth;
+        writers_++;
+    }
+
+    void RemoveWriter()
+    {
+        if (--writers_ != 0)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto &reader : readers_)
+        {
+            reader->Wake();
+        }
+    }
+
+    bool HasWriter() const
+    {
+        return writers_.load(std::memory_order_acquire) != 0;
+    }
+
+    std::size_t Depth() const
+    {
+        return depth_.load(std::memory_order_relaxed);
+    }
+
+    bool HasReaders() const
+    {
+        return reader_count_.load(std::memory_order_acquire) != 0;
+    }
+
+    void Subscribe(const std::shared_ptr<LocalQueue<T>> &reader)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        readers_.push_back(reader);
+        reader_count_ = readers_.size();
+    }
+
+    void Unsubscribe(const std::shared_ptr<LocalQueue<T>> &reader)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = readers_.begin(); it != readers_.end(); ++it)
+        {
+            if (*it == reader)
+            {
+                readers_.erase(it);
+                break;
+            }
+        }
+        reader_count_ = readers_.size();
+    }
+
+    // Hand one shared copy to every in-process reader
+    void Publish(const std::shared_ptr<const T> &msg, std::uint64_t seq, bool keyed, std::uint64_t key)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto &reader : readers_)
+        {
+            reader->Push(msg, seq, keyed, key);
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<LocalQueue<T>>> readers_;
+    std::atomic<std::size_t> reader_count_{0};
+    std::atomic<int> writers_{0};
+    std::atomic<std::size_t> depth_{1};
+    const pid_t pid_ = getpid();
+};
+
+#endif
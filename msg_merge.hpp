@@ -0,0 +1,170 @@
+#ifndef MSG_MERGE_HPP
+#define MSG_MERGE_HPP
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "msg_recv.hpp"
+
+// Reads several channels as one stream in stamp order, e.g. IMU, cameras and odometry for fusion.
+// A message is handed out once every channel has one pending, or once it is older than the reorder
+// window, so a late channel can still slot in an older message within that window.
+// Messages are handed to the callbacks in their shared slots, without intermediate queues.
+class MsgMerge
+{
+public:
+    // window_ns: the longest a message waits for older ones on silent channels
+    explicit MsgMerge(std::uint64_t window_ns)
+        : window_ns_(window_ns)
+    {
+    }
+
+    MsgMerge(const MsgMerge &that) = delete;
+    MsgMerge &operator=(const MsgMerge &that) = delete;
+
+    // Attach to a channel of T, fn(const T &data, std::uint64_t stamp) receives its messages
+    template <typename T, typename F>
+    void Add(const std::string &msg_name, F fn, const MsgOptions &opts = MsgOptions())
+    {
+        sources_.emplace_back(new Channel<T, F>(msg_name, std::move(fn), opts));
+    }
+
+    // Hand the oldest message to its callback, waiting at most tm ms for one to be due
+    bool Next(std::size_t tm = default_timeout)
+    {
+        std::uint64_t deadline = tm == invalid_value ? (std::numeric_limits<std::uint64_t>::max)() : StampNow() + tm * 1000000;
+        for (;;)
+        {
+            Source *oldest = nullptr;
+            std::uint64_t oldest_stamp = 0;
+            // Silent channels, waited on all at once
+            conds_.clear();
+            seqs_.clear();
+            bool detached = false;
+            bool changed = false;
+            for (std::size_t i = 0; i < sources_.size(); ++i)
+            {
+                Source *source = sources_[i].get();
+                std::uint32_t seq = 0;
+                ConditionVar *cond = source->WaitHandle(seq);
+                std::uint64_t stamp;
+                if (source->Peek(stamp, 0))
+                {
+                    if (oldest == nullptr || stamp < oldest_stamp)
+                    {
+                        oldest = source;
+                        oldest_stamp = stamp;
+                    }
+                    continue;
+                }
+                std::uint32_t unused;
+                ConditionVar *after = source->WaitHandle(unused);
+                if (after == nullptr)
+                {
+                    detached = true;
+                    continue;
+                }
+                if (after != cond)
+                {
+                    // The Peek just attached or reconnected, check again rather than wait
+                    changed = true;
+                    continue;
+                }
+                conds_.push_back(cond);
+                seqs_.push_back(seq);
+            }
+
+            bool silent = detached || changed || !conds_.empty();
+            std::uint64_t now = StampNow();
+            std::uint64_t due = oldest == nullptr ? deadline : oldest_stamp + window_ns_;
+            if (oldest != nullptr && (!silent || now >= due))
+            {
+                return oldest->Take();
+            }
+            if (!silent || now >= deadline)
+            {
+                return false;
+            }
+            if (changed)
+            {
+                continue;
+            }
+
+            // Block until any silent channel gets a message or the oldest one is due, rounded up to
+            // whole ms. Channels without a writer yet are retried every detached_wait_ms.
+            std::uint64_t wait_ms = std::max<std::uint64_t>((std::min(due, deadline) - now + 999999) / 1000000, 1);
+            if (detached)
+            {
+                wait_ms = std::min<std::uint64_t>(wait_ms, detached_wait_ms);
+            }
+            if (conds_.empty())
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+            }
+            else
+            {
+                ConditionVar::WaitAny(conds_.data(), seqs_.data(), conds_.size(), static_cast<std::size_t>(wait_ms));
+            }
+        }
+    }
+
+    std::size_t Size() const
+    {
+        return sources_.size();
+    }
+
+private:
+    struct Source
+    {
+        virtual ~Source() = default;
+        virtual ConditionVar *WaitHandle(std::uint32_t &seq) = 0;
+        virtual bool Peek(std::uint64_t &stamp, std::size_t tm) = 0;
+        virtual bool Take() = 0;
+    };
+
+    template <typename T, typename F>
+    struct Channel : Source
+    {
+        Channel(const std::string &msg_name, F &&fn, const MsgOptions &opts)
+            : recv(msg_name, opts), fn(std::move(fn))
+        {
+            // Connect right away, so messages published before the first Next are not missed
+            std::uint64_t stamp;
+            recv.Peek(stamp, 0);
+        }
+
+        ConditionVar *WaitHandle(std::uint32_t &seq) override
+        {
+            return recv.WaitHandle(seq);
+        }
+
+        bool Peek(std::uint64_t &stamp, std::size_t tm) override
+        {
+            return recv.Peek(stamp, tm);
+        }
+
+        bool Take() override
+        {
+            return recv.Take(fn, 0);
+        }
+
+        MsgRecv<T> recv;
+        F fn;
+    };
+
+    // Retry period of channels whose writer did not create them yet
+    enum : std::uint64_t
+    {
+        detached_wait_ms = 100
+    };
+
+    std::uint64_t window_ns_;
+    std::vector<std::unique_ptr<Source>> sources_;
+    // Condition variables of the silent channels and their notification counts, reused by Next
+    std::vector<ConditionVar *> conds_;
+    std::vector<std::uint32_t> seqs_;
+};
+
+#endif
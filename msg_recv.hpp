@@ -2,8 +2,18 @@
 #ifndef MSG_RECV_HPP
 #define MSG_RECV_HPP
 
+#include <sys/inotify.h>
+#include <poll.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "ipc_copy.h"
+#include "ipc_fd.h"
 #include "ipc_lock.h"
 #include "msg_comm.hpp"
+#include "msg_local.hpp"
 
 template <typename T>
 class MsgRecv
@@ -11,10 +21,23 @@ class MsgRecv
 public:
     using Buffer = Item<T>;
 
-    MsgRecv(const std::string &msg_name)
+    MsgRecv(const std::string &msg_name, const MsgOptions &opts = MsgOptions())
     {
         msg_info_.type = typeid(T).hash_code();
         msg_info_.name = std::move(msg_name);
+        anonymous_ = opts.anonymous;
+        key_lo_ = opts.key_lo;
+        key_hi_ = opts.key_hi;
+        group_ = HashName(opts.group);
+        starve_limit_ = opts.starve_limit;
+        replay_ = opts.replay;
+        since_seq_ = opts.since_seq;
+        // Consumer groups share a connection id and replay needs the rings, both read from the segment
+        if (opts.intra_process && group_ == 0 && replay_ == 0 && since_seq_ == 0)
+        {
+            local_ = LocalTopic<T>::Get(msg_info_.name);
+            local_depth_ = opts.capacity;
+        }
         Init();
     }
 
@@ -24,44 +47,100 @@ public:
 
     ~MsgRecv()
     {
+        if (local_queue_)
+        {
+            local_->Unsubscribe(local_queue_);
+        }
+        if (handshake_fd_ != -1)
+        {
+            close(handshake_fd_);
+        }
+        if (inotify_fd_ != -1)
+        {
+            close(inotify_fd_);
+        }
         Release();
     }
 
-    bool Init()
+    // Map the segment. An anonymous channel waits at most tm ms for the writer to hand it over.
+    bool Init(std::size_t tm = default_timeout)
     {
         if (msg_info_.name.empty() || msg_info_.name.at(0) == '\0')
         {
-            printf("MsgRecv failed: msg_name is empty \n");
+            IPC_LOG_ERROR("MsgRecv failed: msg_name is empty");
             return false;
         }
-        int oflag = O_RDWR;
-        int fd = shm_open(msg_info_.name.c_str(), oflag, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+        int fd;
+        if (anonymous_)
+        {
+            // Ask the writer for the descriptor of its memfd segment
+            if (handshake_fd_ == -1)
+            {
+                handshake_fd_ = ipc::fd::Connect(msg_info_.name);
+                if (handshake_fd_ == -1)
+                {
+                    return false;
+                }
+                // Anyone may bind the name first, only take a segment from a trusted process
+                if (!ipc::fd::PeerAllowed(handshake_fd_))
+                {
+                    IPC_LOG_ERROR("MsgRecv: %s, rejected untrusted writer", msg_info_.name.c_str());
+                    close(handshake_fd_);
+                    handshake_fd_ = -1;
+                    return false;
+                }
+            }
+            fd = ipc::fd::Recv(handshake_fd_, tm);
+            // Until the writer gets to Accept, keep the connection for the next attempt
+            if (fd == -1 && errno == ETIMEDOUT)
+            {
+                return false;
+            }
+            close(handshake_fd_);
+            handshake_fd_ = -1;
+        }
+        else
+        {
+            int oflag = O_RDWR;
+            fd = shm_open(msg_info_.name.c_str(), oflag, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+        }
         if (fd == -1)
         {
-            printf("MsgRecv fail shm_open[%d]: %s\n", errno, msg_info_.name.c_str());
+            // The writer has not created the channel yet, the caller may be waiting for it
+            if (errno == ENOENT)
+            {
+                IPC_LOG_DEBUG("MsgRecv no segment yet: %s", msg_info_.name.c_str());
+            }
+            else
+            {
+                IPC_LOG_ERROR("MsgRecv fail shm_open[%d]: %s", errno, msg_info_.name.c_str());
+            }
             return false;
         }
         msg_info_.fd = fd;
         struct stat st;
         if (fstat(fd, &st) != 0)
         {
-            printf("MsgRecv fail fstat[%d]: %s, size = %zd\n", errno, msg_info_.name.c_str(), msg_info_.size);
+            IPC_LOG_ERROR("MsgRecv fail fstat[%d]: %s, size = %zd", errno, msg_info_.name.c_str(), msg_info_.size);
+            close(fd);
             return false;
         }
         msg_info_.size = static_cast<std::size_t>(st.st_size);
+        // Not sized yet by the writer
         if (msg_info_.size <= sizeof(MsgHeader))
         {
-            printf("MsgRecv fail to_mem: %s, invalid size = %zd\n", msg_info_.name.c_str(), msg_info_.size);
+            IPC_LOG_DEBUG("MsgRecv segment not ready: %s, size = %zd", msg_info_.name.c_str(), msg_info_.size);
+            close(fd);
             return false;
         }
 
         void *mem = mmap(nullptr, msg_info_.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
         if (mem == MAP_FAILED)
         {
-            printf("MsgRecv fail mmap[%d]: %s, size = %zd\n", errno, msg_info_.name.c_str(), msg_info_.size);
+            IPC_LOG_ERROR("MsgRecv fail mmap[%d]: %s, size = %zd", errno, msg_info_.name.c_str(), msg_info_.size);
             return false;
         }
-        close(fd);
 
         msg_info_.fd = -1;
         msg_info_.mem = mem;
@@ -70,9 +149,23 @@ public:
         msg_header_ = reinterpret_cast<MsgHeader *>(mem);
         buffer_ = reinterpret_cast<Buffer *>((uint8_t *)mem + sizeof(MsgHeader));
 
-        if (msg_info_.type != msg_header_->type_hash)
+        // The writer stores the type once the header is set up
+        std::size_t type = msg_header_->type_hash.load(std::memory_order_acquire);
+        if (type == 0)
+        {
+            IPC_LOG_DEBUG("MsgRecv segment not initialized yet: %s", msg_info_.name.c_str());
+            Release();
+            return false;
+        }
+        if (msg_info_.type != type)
+        {
+            IPC_LOG_ERROR("MsgRecv type mismatch");
+            Release();
+            return false;
+        }
+        // A segment left behind by a writer that is shutting down
+        if (msg_header_->shut_down)
         {
-            printf("MsgRecv type mismatch\n");
             Release();
             return false;
         }
@@ -82,11 +175,190 @@ public:
     }
 
     bool Get(T &data, std::size_t tm = 0)
+    {
+        std::shared_ptr<const T> msg;
+        bool got;
+        if (GetLocal(msg, tm, got))
+        {
+            if (got)
+            {
+                data = *msg;
+            }
+            return got;
+        }
+        return Read([&data](Buffer &item)
+                    { ipc::copy::LoadObject(data, &item.data); },
+                    tm, true);
+    }
+
+    // Shared ownership of the message: from a writer in this process without any copy,
+    // otherwise a copy of the slot
+    bool Get(std::shared_ptr<const T> &data, std::size_t tm = 0)
+    {
+        bool got;
+        if (GetLocal(data, tm, got))
+        {
+            return got;
+        }
+        std::shared_ptr<T> copy = std::make_shared<T>();
+        if (!Get(*copy, tm))
+        {
+            return false;
+        }
+        data = std::move(copy);
+        return true;
+    }
+
+    // Zero-copy read from the segment: call fn(const T &data, std::uint64_t stamp) on the next message in its slot.
+    // The channel stays locked during the call, keep fn short.
+    template <typename F>
+    bool Take(F &&fn, std::size_t tm = 0)
+    {
+        return Read([&fn](Buffer &item)
+                    { fn(*reinterpret_cast<const T *>(&item.data), item.stamp); },
+                    tm, true);
+    }
+
+    // Publish stamp of the next message without consuming it, waiting at most tm ms for one
+    bool Peek(std::uint64_t &stamp, std::size_t tm = 0)
+    {
+        return Read([&stamp](Buffer &item)
+                    { stamp = item.stamp; },
+                    tm, false);
+    }
+
+
+    // Sequence number of the last message read, 0 before the first one.
+    // Numbers restart from 1 when a new writer creates the segment, they carry over a take-over.
+    std::uint64_t LastSeq() const
+    {
+        return last_seq_;
+    }
+
+    // Condition variable a Peek or Take of this reader waits on, and its notification count as of now,
+    // to wait on several channels at once with ConditionVar::WaitAny. Take it before checking the
+    // channel with Peek(stamp, 0), and again after: a different one means the reader reattached.
+    // nullptr while not attached.
+    ConditionVar *WaitHandle(std::uint32_t &seq)
+    {
+        if (!isValid_ || msg_header_->shut_down)
+        {
+            return nullptr;
+        }
+        ConditionVar &cond = WaitCond();
+        seq = cond.Sequence();
+        return &cond;
+    }
+
+    // Publish counter of the active writer, stalls while no writer is alive
+    std::uint64_t WriterHeartbeat()
+    {
+        if (!isValid_)
+        {
+            return 0;
+        }
+        return msg_header_->heartbeat.load(std::memory_order_relaxed);
+    }
+
+    // Node of the CPU this reader last reported from
+    int Node()
+    {
+        if (!isValid_ || conn_id_ == 0)
+        {
+            return -1;
+        }
+        return msg_header_->Reader(conn_id_).node;
+    }
+
+private:
+    // In-process path, taken while a writer of this process publishes the channel.
+    // False if the reader goes to the segment, otherwise got tells whether a message arrived.
+    bool GetLocal(std::shared_ptr<const T> &msg, std::size_t tm, bool &got)
+    {
+        if (!local_)
+        {
+            return false;
+        }
+        if (!local_->HasWriter())
+        {
+            if (!local_queue_)
+            {
+                return false;
+            }
+            // Drain what the local writer left, then go back to the segment
+            std::uint64_t seq;
+            got = local_queue_->Pop(msg, seq, 0);
+            if (got)
+            {
+                last_seq_ = seq;
+                return true;
+            }
+            local_->Unsubscribe(local_queue_);
+            local_queue_.reset();
+            // The segment kept for the heartbeat is gone with its writer, attach to the next one
+            if (isValid_ && msg_header_->shut_down)
+            {
+                Release();
+            }
+            return false;
+        }
+        if (!local_queue_ && !SwitchLocal())
+        {
+            return false;
+        }
+        std::uint64_t seq;
+        got = local_queue_->Pop(msg, seq, tm);
+        if (got)
+        {
+            last_seq_ = seq;
+        }
+        return true;
+    }
+
+    // Disconnect from the segment for an in-process queue, the writer skips the segment while no other
+    // process reads. The segment stays mapped for WriterHeartbeat.
+    // False while the segment still holds unread messages for this reader, they are read from it first.
+    bool SwitchLocal()
+    {
+        if (!isValid_)
+        {
+            Init(0);
+        }
+        // The writer publishes under the mutex, so no message falls between the segment and the queue
+        bool locked = isValid_ && msg_header_->mutex.Lock();
+        if (isValid_ && !locked)
+        {
+            return false;
+        }
+        bool connected = locked && msg_header_->conn.IsConnected(conn_id_);
+        if (locked && (msg_header_->resized || (connected && NextLane() >= 0)))
+        {
+            msg_header_->mutex.Unlock();
+            return false;
+        }
+        std::size_t depth = local_depth_ != 0 ? local_depth_ : local_->Depth();
+        local_queue_ = std::make_shared<LocalQueue<T>>(depth, key_lo_, key_hi_);
+        local_->Subscribe(local_queue_);
+        if (locked)
+        {
+            if (connected)
+            {
+                Disconnect();
+            }
+            conn_id_ = 0;
+            msg_header_->mutex.Unlock();
+        }
+        return true;
+    }
+
+    // Hand the next readable slot to fn, and mark it read if consume
+    template <typename F>
+    bool Read(F &&fn, std::size_t tm, bool consume)
     {
         // If not properly initialized, try re-init
         if (!isValid_)
         {
-            if (!ReInit())
+            if (!ReInit(tm))
             {
                 return false;
             }
@@ -96,46 +368,76 @@ public:
         {
             msg_header_->mutex.Lock();
 
+            // Follow the writer if it migrated to a larger segment
+            if (msg_header_->resized)
+            {
+                if (!Remap())
+                {
+                    return false;
+                }
+                continue;
+            }
+
             // Check for connection
             if (!msg_header_->conn.IsConnected(conn_id_))
             {
-                printf("MsgRecv: %s disconnected. Try reconnect ... \n", msg_info_.name.c_str());
+                IPC_LOG_INFO("MsgRecv: %s disconnected. Try reconnect ...", msg_info_.name.c_str());
                 if (!Connect())
                 {
-                    printf("MsgRecv: %s reconnect failed ... \n", msg_info_.name.c_str());
+                    IPC_LOG_ERROR("MsgRecv: %s reconnect failed ...", msg_info_.name.c_str());
                     msg_header_->mutex.Unlock();
                     return false;
                 }
-                printf("MsgRecv: %s connected \n", msg_info_.name.c_str());
+                IPC_LOG_INFO("MsgRecv: %s connected", msg_info_.name.c_str());
             }
 
-            std::uint32_t readable = buffer_[ri_].rc & conn_id_;
-
             // Loop to (or wait for) the first readable data
-            while (readable == 0)
+            std::size_t starved = starved_;
+            int lane;
+            while ((lane = NextLane()) < 0)
             {
-                // If the reader index is behind the writer index
-                if (!msg_header_->IsEqualWi(ri_))
-                {
-                    msg_header_->IncRi(ri_);
-                }
-                else if (!msg_header_->cond_not_empty.Wait(msg_header_->mutex, tm))
+                if (!WaitCond().Wait(msg_header_->mutex, tm))
                 {
                     // We cannot exceed anymore, i.e., we need to wait for data production
-                    // printf("MsgRecv fail cond_not_empty.wait: %s\n", msg_info_.name.c_str());
                     msg_header_->mutex.Unlock();
 
                     return false;
                 }
-                readable = buffer_[ri_].rc & conn_id_;
+                else if (msg_header_->resized || msg_header_->shut_down)
+                {
+                    break;
+                }
+                IPC_TRACE(wake_up, conn_id_, 0);
+            }
+            if (lane < 0)
+            {
+                // Woken up by a resize or a shut down, handle it from the top
+                msg_header_->mutex.Unlock();
+                continue;
             }
 
             // We arrived at the first readable data, read it!
+            Buffer &item = buffer_[msg_header_->Index(lane, ri_[lane])];
+            if (!consume)
+            {
+                // A peek does not count against the starvation limit
+                starved_ = starved;
+                fn(item);
+                msg_header_->mutex.Unlock();
+                return true;
+            }
             // Clear the read flag for this reader
-            buffer_[ri_].rc &= ~conn_id_;
+            item.rc &= ~conn_id_;
             // Get the internal data
-            new (&data) T(std::move(*static_cast<T *>(reinterpret_cast<void *>(&buffer_[ri_].data))));
-            ri_ = msg_header_->IncRi(ri_);
+            fn(item);
+            last_seq_ = item.seq;
+            msg_header_->IncRi(ri_[lane]);
+            // A large next message already waiting is fetched while the caller handles this one
+            Buffer &next = buffer_[msg_header_->Index(lane, ri_[lane])];
+            if (ipc::copy::UsePrefetch<T>() && (next.rc & conn_id_) != 0)
+            {
+                ipc::copy::Prefetch(&next.data, sizeof(T));
+            }
 
             msg_header_->mutex.Unlock();
             return true;
@@ -144,7 +446,27 @@ public:
         return false;
     }
 
-private:
+    bool IsTargeted() const
+    {
+        return group_ != 0 || key_lo_ != 0 || key_hi_ != (std::numeric_limits<std::uint64_t>::max)();
+    }
+
+    // Targeted readers are woken up on their own condition variable
+    ConditionVar &WaitCond()
+    {
+        return msg_header_->targeted_mask & conn_id_ ? msg_header_->Slot(conn_id_).cond_ready : msg_header_->cond_not_empty;
+    }
+
+    // Publish where this reader runs, called with the mutex held
+    void ReportLocality()
+    {
+        ReaderInfo &info = msg_header_->Reader(conn_id_);
+        info.conn_id = conn_id_;
+        info.pid = getpid();
+        info.cpu = ipc::numa::CurrentCpu();
+        info.node = ipc::numa::CurrentNode();
+    }
+
     void
     Release()
     {
@@ -154,38 +476,289 @@ private:
         {
             return;
         }
-        // Disconnect
-        msg_header_->conn.DisconnectId(conn_id_);
+        // A writer that shut down may have destroyed the mutex already, nobody needs the id then
+        if (conn_id_ != 0 && !msg_header_->shut_down && msg_header_->mutex.Lock())
+        {
+            Disconnect();
+            msg_header_->mutex.Unlock();
+        }
 
         // Clear the shared memory
         if (munmap(msg_info_.mem, msg_info_.size) != 0)
         {
-            printf("MsgRecv fail munmap[%d]: %s\n", errno, msg_info_.name.c_str());
+            IPC_LOG_ERROR("MsgRecv fail munmap[%d]: %s", errno, msg_info_.name.c_str());
         }
 
         msg_info_.mem = nullptr;
         msg_info_.size = 0;
         conn_id_ = 0;
-        ri_ = 0;
+        std::fill(ri_, ri_ + max_lanes, 0);
     }
 
-    bool ReInit()
+    // Give the connection id back, a consumer group keeps it while other members remain.
+    // Called with the mutex held.
+    void Disconnect()
     {
-        if (Init())
+        ReaderSlot &slot = msg_header_->Slot(conn_id_);
+        if (group_ != 0)
         {
-            tried_cnt_ = 0;
-            return true;
+            slot.RemoveMember(getpid());
         }
-        else if (tried_cnt_ < try_reconnect_cnt_)
+        if (group_ == 0 || slot.members == 0)
         {
-            tried_cnt_++;
+            msg_header_->conn.DisconnectId(conn_id_);
+            msg_header_->targeted_mask &= ~conn_id_;
         }
-        else
+        conn_id_ = 0;
+    }
+
+    // Attach to the channel, waiting at most tm ms for the writer to create it.
+    // Woken up by inotify on /dev/shm instead of polling shm_open.
+    bool ReInit(std::size_t tm)
+    {
+        // A new segment numbers its messages from 1 again
+        last_seq_ = 0;
+
+        // Watch before trying, so that a segment created in between is not missed.
+        // Anonymous channels have no file to watch, a single attempt needs no watch.
+        int fd = -1;
+        if (!anonymous_ && tm != 0)
         {
-            std::this_thread::sleep_for(dura_);
+            fd = Watch();
         }
-        std::cout << "ReInit tried cnt: " << tried_cnt_ << std::endl;
-        return false;
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(tm == invalid_value ? 0 : tm);
+        bool ok = Init(tm);
+        while (!ok && tm != 0)
+        {
+            int wait_ms = -1;
+            if (tm != invalid_value)
+            {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+                if (left.count() <= 0)
+                {
+                    break;
+                }
+                wait_ms = static_cast<int>(left.count());
+            }
+            if (anonymous_ && handshake_fd_ != -1)
+            {
+                // Connected, Init waits for the writer to hand the segment over
+            }
+            else if (fd == -1)
+            {
+                // No inotify, fall back to sleeping between attempts
+                std::this_thread::sleep_for(wait_ms == -1 ? dura_ : std::min(dura_, std::chrono::milliseconds(wait_ms)));
+            }
+            else if (!WaitSegmentEvent(fd, wait_ms))
+            {
+                continue;
+            }
+            ok = Init(wait_ms == -1 ? invalid_value : static_cast<std::size_t>(wait_ms));
+        }
+        return ok;
+    }
+
+    // The inotify descriptor watching /dev/shm, set up on first use and kept for the reader's life.
+    // Events queued while attached are dropped, -1 if inotify is not available.
+    int Watch()
+    {
+        if (inotify_fd_ == -1 && !inotify_failed_)
+        {
+            inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (inotify_fd_ != -1 && inotify_add_watch(inotify_fd_, "/dev/shm", IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE) == -1)
+            {
+                IPC_LOG_ERROR("MsgRecv fail inotify_add_watch[%d]: %s", errno, msg_info_.name.c_str());
+                close(inotify_fd_);
+                inotify_fd_ = -1;
+            }
+            inotify_failed_ = inotify_fd_ == -1;
+            return inotify_fd_;
+        }
+        if (inotify_fd_ != -1)
+        {
+            alignas(inotify_event) char buf[4096];
+            while (read(inotify_fd_, buf, sizeof(buf)) > 0)
+            {
+            }
+        }
+        return inotify_fd_;
+    }
+
+    // Wait for an inotify event on our segment name, false on timeout or unrelated events
+    bool WaitSegmentEvent(int fd, int wait_ms)
+    {
+        pollfd pfd = {fd, POLLIN, 0};
+        int ret = poll(&pfd, 1, wait_ms);
+        if (ret <= 0)
+        {
+            if (ret == -1 && errno != EINTR)
+            {
+                IPC_LOG_ERROR("MsgRecv fail poll[%d]: %s", errno, msg_info_.name.c_str());
+            }
+            return false;
+        }
+
+        // shm_open names map to files under /dev/shm without the leading slash
+        const char *name = msg_info_.name.c_str();
+        if (name[0] == '/')
+        {
+            ++name;
+        }
+        bool matched = false;
+        alignas(inotify_event) char buf[4096];
+        ssize_t len;
+        while ((len = read(fd, buf, sizeof(buf))) > 0)
+        {
+            for (char *p = buf; p < buf + len;)
+            {
+                auto ev = reinterpret_cast<inotify_event *>(p);
+                if (ev->len > 0 && std::strcmp(ev->name, name) == 0)
+                {
+                    matched = true;
+                }
+                p += sizeof(inotify_event) + ev->len;
+            }
+        }
+        return matched;
+    }
+
+    bool Replayable(const Buffer &item) const
+    {
+        return item.seq != 0 && (!item.keyed || (item.key >= key_lo_ && item.key <= key_hi_));
+    }
+
+    // Flag the retained messages a new connection starts with and clear all other flags of its id,
+    // including those a previous holder left behind. A reconnect resumes after the last message read.
+    // Called with the mutex held.
+    void Replay()
+    {
+        std::uint64_t from = last_seq_ != 0 ? last_seq_ + 1 : since_seq_;
+        if (from == 0 && replay_ != 0)
+        {
+            std::vector<std::uint64_t> seqs;
+            for (std::size_t i = 0; i < msg_header_->lanes * msg_header_->capacity; ++i)
+            {
+                if (Replayable(buffer_[i]))
+                {
+                    seqs.push_back(buffer_[i].seq);
+                }
+            }
+            from = 1;
+            if (seqs.size() > replay_)
+            {
+                auto nth = seqs.end() - replay_;
+                std::nth_element(seqs.begin(), nth, seqs.end());
+                from = *nth;
+            }
+        }
+        for (std::size_t lane = 0; lane < msg_header_->lanes; ++lane)
+        {
+            msg_header_->lapped[lane] &= ~conn_id_;
+            for (std::size_t i = 0; i < msg_header_->capacity; ++i)
+            {
+                Buffer &item = buffer_[msg_header_->Index(lane, i)];
+                if (from != 0 && item.seq >= from && Replayable(item))
+                {
+                    item.rc |= conn_id_;
+                }
+                else
+                {
+                    item.rc &= ~conn_id_;
+                }
+            }
+            // Start at the oldest slot, Seek walks up to the newest
+            ri_[lane] = (msg_header_->wi[lane] + 1) % msg_header_->capacity;
+        }
+    }
+
+    // Advance the read index of a lane to the next slot flagged for this reader.
+    // False if the lane has nothing left to read.
+    bool Seek(std::size_t lane)
+    {
+        // Lapped: every slot from the one it lost onwards is newer, so resume at the oldest slot
+        if (msg_header_->lapped[lane] & conn_id_)
+        {
+            msg_header_->lapped[lane] &= ~conn_id_;
+            ri_[lane] = (msg_header_->wi[lane] + 1) % msg_header_->capacity;
+        }
+        while ((buffer_[msg_header_->Index(lane, ri_[lane])].rc & conn_id_) == 0)
+        {
+            if (msg_header_->IsEqualWi(ri_[lane], lane))
+            {
+                return false;
+            }
+            msg_header_->IncRi(ri_[lane]);
+        }
+        return true;
+    }
+
+    // Lane to read from next, -1 if none is readable.
+    // Higher lanes go first, unless a lower lane has been passed over starve_limit_ times.
+    int NextLane()
+    {
+        int first = -1;
+        int lower = -1;
+        for (std::size_t lane = 0; lane < msg_header_->lanes && lower < 0; ++lane)
+        {
+            if (!Seek(lane))
+            {
+                continue;
+            }
+            if (first < 0)
+            {
+                first = static_cast<int>(lane);
+            }
+            else
+            {
+                lower = static_cast<int>(lane);
+            }
+        }
+        if (lower < 0)
+        {
+            starved_ = 0;
+        }
+        else if (starve_limit_ != 0 && ++starved_ > starve_limit_)
+        {
+            starved_ = 0;
+            return lower;
+        }
+        return first;
+    }
+
+    // Follow the writer to its enlarged segment, keeping the connection and the unread messages.
+    // Called with the mutex of the old segment held.
+    bool Remap()
+    {
+        // The writer linearized the old rings, oldest slot first
+        std::size_t cap = msg_header_->capacity;
+        std::size_t ri[max_lanes];
+        for (std::size_t lane = 0; lane < msg_header_->lanes; ++lane)
+        {
+            ri[lane] = (ri_[lane] + cap - (msg_header_->wi[lane] + 1) % cap) % cap;
+        }
+        std::uint32_t generation = msg_header_->generation;
+        std::uint32_t conn_id = conn_id_;
+        msg_header_->mutex.Unlock();
+
+        // The connection id was carried over to the new header, do not drop it
+        conn_id_ = 0;
+        Release();
+        if (!Init())
+        {
+            return false;
+        }
+
+        msg_header_->mutex.Lock();
+        // If the writer resized again in between, start over from a fresh connection
+        if (msg_header_->generation == generation + 1)
+        {
+            conn_id_ = conn_id;
+            std::copy(ri, ri + msg_header_->lanes, ri_);
+        }
+        IPC_TRACE(remap, conn_id_, msg_header_->generation);
+        msg_header_->mutex.Unlock();
+        return true;
     }
 
     bool Connect()
@@ -195,16 +768,63 @@ private:
         {
             return false;
         }
-        std::uint32_t cc = msg_header_->conn.CurConn();
-        if (cc + 1 == 0)
+        // Join the consumer group if one of its members is connected already
+        std::uint32_t group_id = group_ != 0 ? msg_header_->FindGroup(group_) : 0;
+        if (group_id != 0)
         {
-            printf("MsgRecv exceed connection limit: %zd", msg_header_->conn.ConnCount());
-            return false;
+            ReaderSlot &slot = msg_header_->Slot(group_id);
+            if (!slot.AddMember(getpid()) && (slot.ReapMembers() == 0 || !slot.AddMember(getpid())))
+            {
+                IPC_LOG_ERROR("MsgRecv exceed group member limit: %s", msg_info_.name.c_str());
+                return false;
+            }
+            conn_id_ = group_id;
+            // The group shares its flags, join at the newest message
+            for (std::size_t lane = 0; lane < msg_header_->lanes; ++lane)
+            {
+                ri_[lane] = msg_header_->wi[lane];
+            }
         }
+        else
+        {
+            std::uint32_t cc = msg_header_->conn.CurConn();
+            if (cc + 1 == 0 && msg_header_->ReclaimDead() != 0)
+            {
+                cc = msg_header_->conn.CurConn();
+            }
+            if (cc + 1 == 0)
+            {
+                IPC_LOG_ERROR("MsgRecv exceed connection limit: %zd", msg_header_->conn.ConnCount());
+                return false;
+            }
 
-        // TODO: thread-safe
-        conn_id_ = msg_header_->conn.GetConnectId();
-        ri_ = msg_header_->wi == 0 ? msg_header_->capacity - 1 : msg_header_->wi;
+            // TODO: thread-safe
+            conn_id_ = msg_header_->conn.GetConnectId();
+            // Register the key filter and group, so the writer skips this reader for other keys
+            // and wakes up a single member of a group
+            ReaderSlot &slot = msg_header_->Slot(conn_id_);
+            slot.key_lo = key_lo_;
+            slot.key_hi = key_hi_;
+            slot.group = group_;
+            slot.members = 0;
+            std::fill(slot.member_pids, slot.member_pids + max_group_members, 0);
+            if (group_ != 0)
+            {
+                slot.AddMember(getpid());
+            }
+            if (IsTargeted())
+            {
+                msg_header_->targeted_mask |= conn_id_;
+            }
+            else
+            {
+                msg_header_->targeted_mask &= ~conn_id_;
+            }
+            Replay();
+        }
+        starved_ = 0;
+        ReportLocality();
+        IPC_TRACE(reconnect, conn_id_, ri_[0]);
 
         return true;
     }
@@ -217,15 +837,35 @@ private:
     // Indicates if this reader is connected to the writer
     bool isValid_ = false;
 
-    // If shared memory is shutdown or the reader is disconnected,
-    // try reconnect at most try_reconnect_cnt_ times.
-    // Otherwise, sleep dura after every try to reduce CPU load.
-    int try_reconnect_cnt_ = 10;
-    int tried_cnt_ = 0;
+    // Sleep between attach attempts when inotify is not available
     std::chrono::milliseconds dura_{100};
+    // Connection to the writer of an anonymous channel, waiting for its descriptor
+    int handshake_fd_ = -1;
+    // Wakes ReInit up when segments appear under /dev/shm
+    int inotify_fd_ = -1;
+    bool inotify_failed_ = false;
     std::uint32_t conn_id_ = 0; // Connection ID
 
-    std::size_t ri_ = 0;
+    // Read index per priority lane
+    std::size_t ri_[max_lanes] = {};
+    // Reads from a higher lane while a lower one had messages pending
+    std::size_t starve_limit_ = 0;
+    std::size_t starved_ = 0;
+    bool anonymous_ = false;
+    // Key range registered with the writer
+    std::uint64_t key_lo_ = 0;
+    std::uint64_t key_hi_ = (std::numeric_limits<std::uint64_t>::max)();
+    // Hash of the consumer group name, 0 for broadcast delivery
+    std::uint64_t group_ = 0;
+    // Replay window of a new connection, see MsgOptions
+    std::size_t replay_ = 0;
+    std::uint64_t since_seq_ = 0;
+    // Sequence number of the last message read on the current segment
+    std::uint64_t last_seq_ = 0;
+    // Channel within this process, and the queue while served from it
+    std::shared_ptr<LocalTopic<T>> local_;
+    std::shared_ptr<LocalQueue<T>> local_queue_;
+    std::size_t local_depth_ = 0;
 };
 
 #endif
@@ -0,0 +1,51 @@
+#ifndef MSG_RELAY_HPP
+#define MSG_RELAY_HPP
+
+#include "msg_recv.hpp"
+#include "msg_send.hpp"
+
+// Feeds a node-local replica of a channel, so readers on another socket
+// read from local memory instead of paying remote latency on every slot.
+// Run Pump from a thread on the target node.
+template <typename T, std::size_t N = 1>
+class MsgRelay
+{
+public:
+    MsgRelay(const std::string &src_name, const std::string &replica_name, int node = ipc::numa::local_node)
+        : recv_(src_name), send_(replica_name, ReplicaOptions(node))
+    {
+    }
+
+    MsgRelay() = delete;
+    MsgRelay(const MsgRelay &that) = delete;
+    MsgRelay &operator=(const MsgRelay &that) = delete;
+
+    // Forward one message, waiting at most tm ms for it
+    bool Pump(std::size_t tm = default_timeout)
+    {
+        if (!recv_.Get(data_, tm))
+        {
+            return false;
+        }
+        return send_.Pub(data_);
+    }
+
+    MsgSend<T, N> &Replica()
+    {
+        return send_;
+    }
+
+private:
+    static MsgOptions ReplicaOptions(int node)
+    {
+        MsgOptions opts;
+        opts.numa_node = node;
+        return opts;
+    }
+
+    MsgRecv<T> recv_;
+    MsgSend<T, N> send_;
+    T data_;
+};
+
+#endif
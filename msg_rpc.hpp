@@ -0,0 +1,459 @@
+#ifndef MSG_RPC_HPP
+#define MSG_RPC_HPP
+
+#include <signal.h>
+
+#include "ipc_lock.h"
+#include "msg_comm.hpp"
+
+// Request/response over one shared segment holding a request ring and a table of reply slots.
+// Every call claims its own reply slot, so a client may have several calls in flight.
+enum : std::size_t
+{
+    rpc_reply_slots = 64
+};
+
+// Reside in shared memory header for synchronization
+struct alignas(64) RpcHeader
+{
+    std::atomic_bool shut_down = ATOMIC_VAR_INIT(false);
+    Mutex mutex;
+    ConditionVar cond_request;
+    ConditionVar cond_not_full;
+
+    // Request ring
+    std::size_t capacity;
+    std::size_t head = 0;
+    std::size_t count = 0;
+
+    size_t req_hash;
+    size_t resp_hash;
+
+    // Correlation id of the next call
+    std::uint64_t next_id = 0;
+    // Claimed reply slots
+    std::uint64_t reply_mask = 0;
+};
+
+template <typename Req>
+struct RpcRequest
+{
+    typename std::aligned_storage<sizeof(Req), alignof(Req)>::type data{};
+    std::uint64_t id = 0;
+    std::uint32_t slot = 0;
+};
+
+template <typename Resp>
+struct RpcReply
+{
+    typename std::aligned_storage<sizeof(Resp), alignof(Resp)>::type data{};
+    ConditionVar cond_ready;
+    // Correlation id of the pending call, 0 if abandoned
+    std::uint64_t id = 0;
+    pid_t pid = 0;
+    bool ready = false;
+};
+
+template <typename Req, typename Resp>
+struct RpcLayout
+{
+    static RpcReply<Resp> *Replies(void *mem)
+    {
+        return reinterpret_cast<RpcReply<Resp> *>((uint8_t *)mem + sizeof(RpcHeader));
+    }
+
+    static RpcRequest<Req> *Requests(void *mem)
+    {
+        return reinterpret_cast<RpcRequest<Req> *>(Replies(mem) + rpc_reply_slots);
+    }
+
+    static std::size_t TotalSize(std::size_t capacity)
+    {
+        return sizeof(RpcHeader) + rpc_reply_slots * sizeof(RpcReply<Resp>) + capacity * sizeof(RpcRequest<Req>);
+    }
+};
+
+template <typename Req, typename Resp, std::size_t N = 16>
+class RpcServer
+{
+public:
+    using Layout = RpcLayout<Req, Resp>;
+
+    RpcServer(const std::string &rpc_name, const MsgOptions &opts = MsgOptions())
+    {
+        msg_info_.name = std::move(rpc_name);
+        capacity_ = opts.capacity == 0 ? N : opts.capacity;
+        prio_inherit_ = opts.prio_inherit;
+        Connect();
+    }
+
+    RpcServer() = delete;
+    RpcServer(const RpcServer &that) = delete;
+    RpcServer &operator=(const RpcServer &that) = delete;
+
+    ~RpcServer()
+    {
+        if (!isValid_)
+        {
+            return;
+        }
+        isValid_ = false;
+        // Fail the pending and future calls
+        header_->mutex.Lock();
+        header_->shut_down = true;
+        header_->cond_not_full.Broadcast();
+        for (std::size_t i = 0; i < rpc_reply_slots; ++i)
+        {
+            replies_[i].cond_ready.Broadcast();
+        }
+        header_->mutex.Unlock();
+
+        if (munmap(msg_info_.mem, msg_info_.size) != 0)
+        {
+            IPC_LOG_ERROR("RpcServer fail munmap[%d]: %s", errno, msg_info_.name.c_str());
+            return;
+        }
+        if (shm_unlink(msg_info_.name.c_str()) != 0)
+        {
+            IPC_LOG_ERROR("RpcServer fail shm_unlink[%d]: %s", errno, msg_info_.name.c_str());
+            return;
+        }
+    }
+
+    bool Connect()
+    {
+        if (msg_info_.name.empty() || msg_info_.name.at(0) == '\0')
+        {
+            IPC_LOG_ERROR("RpcServer failed: rpc_name is empty");
+            return false;
+        }
+        int fd = shm_open(msg_info_.name.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+        if (fd == -1)
+        {
+            IPC_LOG_ERROR("RpcServer fail shm_open[%d]: %s", errno, msg_info_.name.c_str());
+            return false;
+        }
+        msg_info_.size = Layout::TotalSize(capacity_);
+        if (ftruncate(fd, static_cast<off_t>(msg_info_.size)) != 0)
+        {
+            IPC_LOG_ERROR("RpcServer fail ftruncate[%d]: %s, size = %zd", errno, msg_info_.name.c_str(), msg_info_.size);
+            close(fd);
+            return false;
+        }
+        void *mem = mmap(nullptr, msg_info_.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED)
+        {
+            IPC_LOG_ERROR("RpcServer fail mmap[%d]: %s, size = %zd", errno, msg_info_.name.c_str(), msg_info_.size);
+            close(fd);
+            return false;
+        }
+        msg_info_.mem = mem;
+
+        // Initialize the contents in shared memory
+        header_ = reinterpret_cast<RpcHeader *>(mem);
+        replies_ = Layout::Replies(mem);
+        requests_ = Layout::Requests(mem);
+
+        header_->capacity = capacity_;
+        header_->req_hash = typeid(Req).hash_code();
+        header_->resp_hash = typeid(Resp).hash_code();
+        header_->mutex.Open(prio_inherit_);
+        header_->cond_request.Open();
+        header_->cond_not_full.Open();
+        for (std::size_t i = 0; i < rpc_reply_slots; ++i)
+        {
+            replies_[i].cond_ready.Open();
+        }
+
+        close(fd);
+        isValid_ = true;
+        return true;
+    }
+
+    bool IsValid()
+    {
+        return isValid_;
+    }
+
+    // Wait at most tm ms for a request and answer it with handler(const Req &, Resp &).
+    // The handler runs outside the lock, several threads may serve concurrently.
+    template <typename F>
+    bool Serve(F handler, std::size_t tm = invalid_value)
+    {
+        if (!isValid_)
+        {
+            return false;
+        }
+
+        header_->mutex.Lock();
+        while (header_->count == 0)
+        {
+            if (!header_->cond_request.Wait(header_->mutex, tm) || header_->shut_down)
+            {
+                header_->mutex.Unlock();
+                return false;
+            }
+        }
+        RpcRequest<Req> &item = requests_[header_->head];
+        Req req(std::move(*reinterpret_cast<Req *>(&item.data)));
+        std::uint64_t id = item.id;
+        std::uint32_t slot = item.slot;
+        header_->head = (header_->head + 1) % header_->capacity;
+        header_->count--;
+        header_->cond_not_full.Notify();
+        header_->mutex.Unlock();
+
+        Resp resp;
+        handler(static_cast<const Req &>(req), resp);
+
+        header_->mutex.Lock();
+        // The caller may have timed out and given the slot up meanwhile
+        RpcReply<Resp> &reply = replies_[slot];
+        if (reply.id == id)
+        {
+            new (&reply.data) Resp(std::move(resp));
+            reply.ready = true;
+            reply.cond_ready.Notify();
+        }
+        header_->mutex.Unlock();
+        return true;
+    }
+
+private:
+    RpcHeader *header_;
+    RpcReply<Resp> *replies_;
+    RpcRequest<Req> *requests_;
+    MsgInfo msg_info_;
+    std::size_t capacity_ = N;
+    bool prio_inherit_ = false;
+
+    bool isValid_ = false;
+};
+
+template <typename Req, typename Resp>
+class RpcClient
+{
+public:
+    using Layout = RpcLayout<Req, Resp>;
+
+    RpcClient(const std::string &rpc_name, const MsgOptions &opts = MsgOptions())
+    {
+        msg_info_.name = std::move(rpc_name);
+        // Writer-preferring, so a reattach is not starved by a stream of calls
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(&attach_lock_, &attr);
+        pthread_rwlockattr_destroy(&attr);
+        Init();
+    }
+
+    RpcClient() = delete;
+    RpcClient(const RpcClient &that) = delete;
+    RpcClient &operator=(const RpcClient &that) = delete;
+
+    ~RpcClient()
+    {
+        Release();
+        pthread_rwlock_destroy(&attach_lock_);
+    }
+
+    bool Init()
+    {
+        if (msg_info_.name.empty() || msg_info_.name.at(0) == '\0')
+        {
+            IPC_LOG_ERROR("RpcClient failed: rpc_name is empty");
+            return false;
+        }
+        int fd = shm_open(msg_info_.name.c_str(), O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+        if (fd == -1)
+        {
+            IPC_LOG_ERROR("RpcClient fail shm_open[%d]: %s", errno, msg_info_.name.c_str());
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            IPC_LOG_ERROR("RpcClient fail fstat[%d]: %s", errno, msg_info_.name.c_str());
+            close(fd);
+            return false;
+        }
+        msg_info_.size = static_cast<std::size_t>(st.st_size);
+        if (msg_info_.size <= Layout::TotalSize(0))
+        {
+            IPC_LOG_ERROR("RpcClient fail to_mem: %s, invalid size = %zd", msg_info_.name.c_str(), msg_info_.size);
+            close(fd);
+            return false;
+        }
+        void *mem = mmap(nullptr, msg_info_.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED)
+        {
+            IPC_LOG_ERROR("RpcClient fail mmap[%d]: %s, size = %zd", errno, msg_info_.name.c_str(), msg_info_.size);
+            return false;
+        }
+        msg_info_.mem = mem;
+
+        header_ = reinterpret_cast<RpcHeader *>(mem);
+        replies_ = Layout::Replies(mem);
+        requests_ = Layout::Requests(mem);
+
+        if (header_->req_hash != typeid(Req).hash_code() || header_->resp_hash != typeid(Resp).hash_code())
+        {
+            IPC_LOG_ERROR("RpcClient type mismatch: %s", msg_info_.name.c_str());
+            Release();
+            return false;
+        }
+        if (header_->shut_down)
+        {
+            Release();
+            return false;
+        }
+        isValid_ = true;
+        return true;
+    }
+
+    // Send req and wait at most tm ms in all for room in the queue and the reply.
+    // Thread-safe, every call has its own reply slot. After a server restart the first call
+    // reattaches, once the calls still running on the old segment have returned.
+    bool Call(const Req &req, Resp &resp, std::size_t tm = default_timeout)
+    {
+        pthread_rwlock_rdlock(&attach_lock_);
+        if (!isValid_ || header_->shut_down)
+        {
+            pthread_rwlock_unlock(&attach_lock_);
+            pthread_rwlock_wrlock(&attach_lock_);
+            // Another thread may have reattached meanwhile
+            if (!isValid_ || header_->shut_down)
+            {
+                Release();
+                Init();
+            }
+            pthread_rwlock_unlock(&attach_lock_);
+            pthread_rwlock_rdlock(&attach_lock_);
+            if (!isValid_)
+            {
+                pthread_rwlock_unlock(&attach_lock_);
+                return false;
+            }
+        }
+        bool ok = CallAttached(req, resp, tm);
+        pthread_rwlock_unlock(&attach_lock_);
+        return ok;
+    }
+
+private:
+    // Body of Call, with the segment held attached
+    bool CallAttached(const Req &req, Resp &resp, std::size_t tm)
+    {
+        // One deadline for the whole call, each wait gets the time left. Waits return early on
+        // spurious wake-ups, so they are not counted.
+        std::uint64_t deadline = tm == invalid_value ? 0 : StampNow() + tm * 1000000;
+        auto left = [&]() -> std::size_t
+        {
+            if (tm == invalid_value)
+            {
+                return invalid_value;
+            }
+            std::uint64_t now = StampNow();
+            // Rounded up, a wait of 0 ms gives up
+            return now >= deadline ? 0 : static_cast<std::size_t>((deadline - now + 999999) / 1000000);
+        };
+
+        header_->mutex.Lock();
+        int slot = ClaimSlot();
+        if (slot < 0)
+        {
+            IPC_LOG_ERROR("RpcClient: %s, too many calls in flight", msg_info_.name.c_str());
+            header_->mutex.Unlock();
+            return false;
+        }
+        RpcReply<Resp> &reply = replies_[slot];
+
+        while (header_->count == header_->capacity)
+        {
+            if (!header_->cond_not_full.Wait(header_->mutex, left()) || header_->shut_down)
+            {
+                FreeSlot(slot);
+                header_->mutex.Unlock();
+                return false;
+            }
+        }
+
+        std::uint64_t id = ++header_->next_id;
+        RpcRequest<Req> &item = requests_[(header_->head + header_->count) % header_->capacity];
+        new (&item.data) Req(req);
+        item.id = id;
+        item.slot = static_cast<std::uint32_t>(slot);
+        header_->count++;
+        reply.id = id;
+        reply.ready = false;
+        header_->cond_request.Notify();
+
+        while (!reply.ready)
+        {
+            if (!reply.cond_ready.Wait(header_->mutex, left()) || header_->shut_down)
+            {
+                // Give the slot up, a late reply does not match the id anymore
+                FreeSlot(slot);
+                header_->mutex.Unlock();
+                return false;
+            }
+        }
+        new (&resp) Resp(std::move(*reinterpret_cast<Resp *>(&reply.data)));
+        FreeSlot(slot);
+        header_->mutex.Unlock();
+        return true;
+    }
+
+    // Find a free reply slot, reclaiming slots of dead callers. Called with the mutex held.
+    int ClaimSlot()
+    {
+        for (int i = 0; i < static_cast<int>(rpc_reply_slots); ++i)
+        {
+            std::uint64_t bit = 1ull << i;
+            pid_t pid = replies_[i].pid;
+            bool dead = (header_->reply_mask & bit) && pid > 0 && kill(pid, 0) != 0 && errno == ESRCH;
+            if (!(header_->reply_mask & bit) || dead)
+            {
+                header_->reply_mask |= bit;
+                replies_[i].pid = getpid();
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void FreeSlot(int slot)
+    {
+        replies_[slot].id = 0;
+        replies_[slot].pid = 0;
+        header_->reply_mask &= ~(1ull << slot);
+    }
+
+    void Release()
+    {
+        isValid_ = false;
+        if (msg_info_.mem == nullptr || msg_info_.size == 0)
+        {
+            return;
+        }
+        if (munmap(msg_info_.mem, msg_info_.size) != 0)
+        {
+            IPC_LOG_ERROR("RpcClient fail munmap[%d]: %s", errno, msg_info_.name.c_str());
+        }
+        msg_info_.mem = nullptr;
+        msg_info_.size = 0;
+    }
+
+    RpcHeader *header_ = nullptr;
+    RpcReply<Resp> *replies_ = nullptr;
+    RpcRequest<Req> *requests_ = nullptr;
+    MsgInfo msg_info_;
+    // Shared by the calls, exclusive while reattaching
+    pthread_rwlock_t attach_lock_;
+
+    bool isValid_ = false;
+};
+
+#endif
@@ -1,19 +1,40 @@
 #ifndef MSG_SEND_HPP
 #define MSG_SEND_HPP
 
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "ipc_copy.h"
+#include "ipc_fd.h"
 #include "ipc_lock.h"
 #include "msg_comm.hpp"
+#include "msg_local.hpp"
+#include "shm_linux.h"
 
 template <typename T, std::size_t N = 1>
 class MsgSend
 {
 public:
     using Buffer = Item<T>;
-    MsgSend(const std::string &msg_name)
+    MsgSend(const std::string &msg_name, const MsgOptions &opts = MsgOptions())
     {
         msg_info_.type = typeid(T).hash_code();
         msg_info_.name = std::move(msg_name);
-        Connect();
+        capacity_ = opts.capacity == 0 ? N : opts.capacity;
+        lanes_ = std::min<std::size_t>(std::max<std::size_t>(opts.lanes, 1), max_lanes);
+        numa_node_ = opts.numa_node;
+        prio_inherit_ = opts.prio_inherit;
+        anonymous_ = opts.anonymous;
+        // Priority lanes are only honoured by the segment
+        if (opts.intra_process && lanes_ == 1)
+        {
+            local_ = LocalTopic<T>::Get(msg_info_.name);
+        }
+        if (!opts.standby)
+        {
+            Connect();
+        }
     }
 
     MsgSend() = delete;
@@ -27,24 +48,56 @@ public:
             return;
         }
         isValid_ = false;
+        if (local_)
+        {
+            local_->RemoveWriter();
+        }
         // Notify the readers
         msg_header_->shut_down = true;
-        msg_header_->cond_not_empty.Broadcast();
+        msg_header_->WakeAll();
 
-        // Close the synchronization stuffs
+        // Close the synchronization stuffs.
+        // The owner lock is left open as a standby writer may still be waiting on it.
         msg_header_->mutex.Close();
         msg_header_->cond_not_empty.Close();
+        owner_.reset();
+
+        // Back to the pool unless a reader or a standby writer still maps it
+        if (pooled_)
+        {
+            ipc::shm::segment_t seg;
+            seg.fd_ = msg_info_.fd;
+            seg.mem_ = msg_info_.mem;
+            seg.size_ = msg_info_.size;
+            if (ipc::shm::pool_give(seg, msg_info_.name.c_str()))
+            {
+                return;
+            }
+        }
 
         // Clear the shared memory
         if (munmap(msg_info_.mem, msg_info_.size) != 0)
         {
-            printf("MsgSend fail munmap[%d]: %s\n", errno, msg_info_.name.c_str());
+            IPC_LOG_ERROR("MsgSend fail munmap[%d]: %s", errno, msg_info_.name.c_str());
             return;
         }
 
+        if (pooled_)
+        {
+            // Unlinked already, by the pool
+            close(msg_info_.fd);
+            return;
+        }
+        if (anonymous_)
+        {
+            // Nothing to unlink, the memory goes away with the last descriptor and mapping
+            close(msg_info_.fd);
+            close(listen_fd_);
+            return;
+        }
         if (shm_unlink(msg_info_.name.c_str()) != 0)
         {
-            printf("MsgSend fail shm_unlink[%d]: %s\n", errno, msg_info_.name.c_str());
+            IPC_LOG_ERROR("MsgSend fail shm_unlink[%d]: %s", errno, msg_info_.name.c_str());
             return;
         }
     }
@@ -53,45 +106,121 @@ public:
     {
         if (msg_info_.name.empty() || msg_info_.name.at(0) == '\0')
         {
-            printf("MsgSend failed: msg_name is empty \n");
+            IPC_LOG_ERROR("MsgSend failed: msg_name is empty");
             return false;
         }
-        int oflag = O_RDWR | O_CREAT | O_TRUNC;
-        int fd = shm_open(msg_info_.name.c_str(), oflag, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-        if (fd == -1)
+        if (anonymous_ && listen_fd_ == -1 && (listen_fd_ = ipc::fd::Listen(msg_info_.name)) == -1)
         {
-            printf("MsgSend fail shm_open[%d]: %s\n", errno, msg_info_.name.c_str());
             return false;
         }
-        msg_info_.fd = fd;
-        msg_info_.size = GetTotalSize(N, sizeof(T));
-        if (ftruncate(fd, static_cast<off_t>(msg_info_.size)) != 0)
+        if (!Create(capacity_))
         {
-            printf("MsgSend fail ftruncate[%d]: %s, size = %zd\n", errno, msg_info_.name.c_str(), msg_info_.size);
             return false;
         }
-        void *mem = mmap(nullptr, msg_info_.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-        if (mem == MAP_FAILED)
+
+        if (local_ && !isValid_)
         {
-            printf("MsgSend fail mmap[%d]: %s, size = %zd\n", errno, msg_info_.name.c_str(), msg_info_.size);
-            return false;
+            local_->AddWriter(capacity_);
         }
-        close(fd);
-        msg_info_.fd = -1;
-        msg_info_.mem = mem;
+        isValid_ = true;
+        return true;
+    }
 
-        // Initialize the contents in shared memory
-        msg_header_ = reinterpret_cast<MsgHeader *>(mem);
-        buffer_ = reinterpret_cast<Buffer *>((uint8_t *)mem + sizeof(MsgHeader));
+    // Block as a hot standby until the active writer dies, then continue publishing on its segment.
+    // Attached readers keep their mapping and go on from the next message.
+    bool TakeOver()
+    {
+        if (isValid_)
+        {
+            return true;
+        }
+        if (msg_info_.name.empty() || msg_info_.name.at(0) == '\0')
+        {
+            IPC_LOG_ERROR("MsgSend failed: msg_name is empty");
+            return false;
+        }
+        if (anonymous_)
+        {
+            IPC_LOG_ERROR("MsgSend fail take over: %s, anonymous channels cannot be attached by name", msg_info_.name.c_str());
+            return false;
+        }
+        for (;;)
+        {
+            if (!Attach())
+            {
+                // No live segment, become the active writer
+                return Connect();
+            }
+            // Returns once the active writer died or gave up the segment
+            owner_.reset(new LockHolder());
+            if (!owner_->Acquire(msg_header_->owner))
+            {
+                owner_.reset();
+                Detach();
+                return false;
+            }
+            if (msg_header_->shut_down || msg_header_->resized)
+            {
+                // Shut down or migrated, the segment under this name is not live anymore
+                owner_.reset();
+                Detach();
+                continue;
+            }
+            msg_header_->writer_pid = getpid();
+            capacity_ = msg_header_->capacity;
+            lanes_ = msg_header_->lanes;
+            isValid_ = true;
+            if (local_)
+            {
+                local_->AddWriter(capacity_);
+            }
+            IPC_LOG_WARN("MsgSend: %s taken over", msg_info_.name.c_str());
+            IPC_TRACE(take_over, msg_header_->writer_pid, 0);
+            return true;
+        }
+    }
 
-        msg_header_->type_hash = msg_info_.type;
-        msg_header_->capacity = N;
-        msg_header_->size = 0;
-        msg_header_->mutex.Open();
-        msg_header_->cond_not_empty.Open();
+    // Hand the segment of an anonymous channel to one authorized reader within tm ms.
+    // Keep calling it from a helper thread while readers may attach, but not concurrently with Resize.
+    bool Accept(std::size_t tm = default_timeout)
+    {
+        if (!isValid_ || !anonymous_)
+        {
+            return false;
+        }
+        int sock = ipc::fd::Accept(listen_fd_, tm);
+        if (sock == -1)
+        {
+            return false;
+        }
+        bool ok = false;
+        if (!ipc::fd::PeerAllowed(sock))
+        {
+            IPC_LOG_WARN("MsgSend: %s, rejected unauthorized reader", msg_info_.name.c_str());
+        }
+        else
+        {
+            ok = ipc::fd::Send(sock, msg_info_.fd);
+        }
+        close(sock);
+        return ok;
+    }
 
-        isValid_ = true;
-        return true;
+    // Where the connected readers run, to tune the placement of the segment
+    std::vector<ReaderInfo> Subscribers()
+    {
+        std::vector<ReaderInfo> infos;
+        if (!isValid_)
+        {
+            return infos;
+        }
+        msg_header_->mutex.Lock();
+        for (std::uint32_t mask = msg_header_->conn.CurConn(); mask != 0; mask &= mask - 1)
+        {
+            infos.push_back(msg_header_->Reader(mask & ~(mask - 1)));
+        }
+        msg_header_->mutex.Unlock();
+        return infos;
     }
 
     bool IsValid()
@@ -99,6 +228,120 @@ public:
         return isValid_;
     }
 
+    std::size_t Capacity() const
+    {
+        return capacity_;
+    }
+
+    // Migrate to a larger segment under the same name.
+    // Unread messages are carried over and attached readers follow on their next Get.
+    bool Resize(std::size_t capacity)
+    {
+        if (!isValid_)
+        {
+            return false;
+        }
+        if (capacity <= capacity_)
+        {
+            IPC_LOG_ERROR("MsgSend fail resize: %s, capacity %zd -> %zd, only growing is supported",
+                   msg_info_.name.c_str(), capacity_, capacity);
+            return false;
+        }
+
+        MsgHeader *old_header = msg_header_;
+        Buffer *old_buffer = buffer_;
+        MsgInfo old_info = msg_info_;
+        bool old_pooled = pooled_;
+
+        // The new segment gets an owner lock of its own
+        std::unique_ptr<LockHolder> old_owner(std::move(owner_));
+        auto restore = [&]
+        {
+            msg_header_ = old_header;
+            buffer_ = old_buffer;
+            msg_info_ = old_info;
+            pooled_ = old_pooled;
+            owner_ = std::move(old_owner);
+            old_header->mutex.Unlock();
+        };
+        old_header->mutex.Lock();
+        // Built without a name, the old segment keeps it until the new one is complete
+        if (!Create(capacity, true))
+        {
+            restore();
+            return false;
+        }
+
+        // Linearize the old rings, oldest slot first, so readers can translate their index
+        std::size_t old_cap = old_header->capacity;
+        for (std::size_t lane = 0; lane < lanes_; ++lane)
+        {
+            std::size_t start = (old_header->wi[lane] + 1) % old_cap;
+            for (std::size_t i = 0; i < old_cap; ++i)
+            {
+                Buffer &src = old_buffer[old_header->Index(lane, (start + i) % old_cap)];
+                // Read messages are kept for replay
+                if (src.seq == 0)
+                {
+                    continue;
+                }
+                Buffer &dst = buffer_[msg_header_->Index(lane, i)];
+                // Copied, the old ring stays intact should the new segment not get the name
+                new (&dst.data) T(*reinterpret_cast<const T *>(&src.data));
+                dst.rc = src.rc;
+                dst.keyed = src.keyed;
+                dst.seq = src.seq;
+                dst.key = src.key;
+                dst.stamp = src.stamp;
+            }
+            msg_header_->wi[lane] = old_cap - 1;
+        }
+        msg_header_->seq.store(old_header->seq.load());
+        msg_header_->conn = old_header->conn;
+        std::memcpy(msg_header_->readers, old_header->readers, sizeof(old_header->readers));
+        msg_header_->targeted_mask = old_header->targeted_mask;
+        std::copy(old_header->lapped, old_header->lapped + max_lanes, msg_header_->lapped);
+        for (std::size_t i = 0; i < 32; ++i)
+        {
+            msg_header_->slots[i].key_lo = old_header->slots[i].key_lo;
+            msg_header_->slots[i].key_hi = old_header->slots[i].key_hi;
+            msg_header_->slots[i].group = old_header->slots[i].group;
+            msg_header_->slots[i].members = old_header->slots[i].members;
+            std::copy(old_header->slots[i].member_pids, old_header->slots[i].member_pids + max_group_members,
+                      msg_header_->slots[i].member_pids);
+        }
+        msg_header_->generation = old_header->generation + 1;
+
+        // Swap the name over to the complete segment, readers attaching from now on see the copied state.
+        // Readers keep their mapping of the old segment until they see the resized flag.
+        if (!anonymous_ && !Name(true))
+        {
+            IPC_LOG_ERROR("MsgSend fail resize: %s, the new segment cannot take the name", msg_info_.name.c_str());
+            Drop();
+            restore();
+            return false;
+        }
+
+        // Wake up the readers so they follow to the new segment
+        old_header->resized = true;
+        old_header->WakeAll();
+        old_header->mutex.Unlock();
+        // Let a standby writer move on to the new segment
+        old_owner.reset();
+
+        if (munmap(old_info.mem, old_info.size) != 0)
+        {
+            IPC_LOG_ERROR("MsgSend fail munmap[%d]: %s", errno, old_info.name.c_str());
+        }
+        // Anonymous and pooled segments kept their descriptor
+        if (old_info.fd != -1)
+        {
+            close(old_info.fd);
+        }
+        capacity_ = capacity;
+        return true;
+    }
+
     void ShutDown()
     {
         if (!isValid_)
@@ -107,46 +350,125 @@ public:
         }
         // Notify the readers
         msg_header_->shut_down = true;
-        msg_header_->cond_not_empty.Broadcast();
+        msg_header_->WakeAll();
     }
 
+    // Publish to the lowest-priority lane
     bool Pub(const T &data)
+    {
+        return Publish(data, lanes_ - 1, false, 0, StampNow());
+    }
+
+    // Publish a message tagged with key.
+    // Readers filtering on a key range without it are neither flagged nor woken up.
+    bool Pub(const T &data, std::uint64_t key)
+    {
+        return Publish(data, lanes_ - 1, true, key, StampNow());
+    }
+
+    // Publish to a priority lane, readers drain lane 0 first
+    bool PubLane(const T &data, std::size_t lane)
+    {
+        return Publish(data, lane, false, 0, StampNow());
+    }
+
+    bool PubLane(const T &data, std::size_t lane, std::uint64_t key)
+    {
+        return Publish(data, lane, true, key, StampNow());
+    }
+
+    // Publish with the time the data was taken instead of the publish time, in StampNow() units.
+    // Merge readers order by it.
+    bool PubStamp(const T &data, std::uint64_t stamp)
+    {
+        return Publish(data, lanes_ - 1, false, 0, stamp);
+    }
+
+    std::size_t Lanes() const
+    {
+        return lanes_;
+    }
+
+private:
+    bool Publish(const T &data, std::size_t lane, bool keyed, std::uint64_t key, std::uint64_t stamp)
     {
         // If this SendMsg is not valid, e.g., not properly initialized
-        if (!isValid_)
+        if (!isValid_ || lane >= lanes_)
         {
             return false;
         }
 
+        // Readers in this process share one immutable copy, made before taking the mutex
+        std::shared_ptr<const T> shared;
+        if (local_ && local_->HasReaders())
+        {
+            shared = std::make_shared<const T>(data);
+            // No other process reads: skip the segment and its mutex. A reader of another process
+            // connecting meanwhile starts after this message, as if it came just before.
+            // A reader of this process subscribes before it disconnects, seeing it gone means the
+            // queue gets the message.
+            if (msg_header_->conn.CurConnUnlocked() == 0 && !msg_header_->shut_down)
+            {
+                local_->Publish(shared, ++msg_header_->seq, keyed, key);
+                msg_header_->heartbeat.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+
         // Connected readers
         msg_header_->mutex.Lock();
         std::uint32_t cc = msg_header_->conn.CurConn();
-        std::cout << "cc:" << cc << std::endl;
         // Check the msg is not shut_down and there exists at least a reader
         while (!msg_header_->shut_down)
         {
+            std::uint64_t seq = ++msg_header_->seq;
+            // Checked again under the mutex, a reader subscribes with it held
+            if (local_ && local_->HasReaders())
+            {
+                if (!shared)
+                {
+                    shared = std::make_shared<const T>(data);
+                }
+                local_->Publish(shared, seq, keyed, key);
+                // No other process reads: skip the segment
+                if (cc == 0)
+                {
+                    msg_header_->heartbeat.fetch_add(1, std::memory_order_relaxed);
+                    msg_header_->mutex.Unlock();
+                    return true;
+                }
+            }
+
             // The reader flags
-            auto write_index = (msg_header_->wi + 1) % msg_header_->capacity;
-            auto item_rc = buffer_[write_index].rc;
-            // Check which readers have not read the data
-            std::uint32_t rem_rc = item_rc & 0xffffffff;
-            // if (cc & item_rc)
-            // {
-            //     printf("force push data: cc = %u, rem_rc = %u \n", cc, rem_rc);
-            //     // cc = msg_header_->conn.DisconnectId(rem_rc);
-            //     // if (cc == 0)
-            //     // {
-            //     //     msg_header_->mutex.Unlock();
-            //     //     return false;
-            //     // }
-            // }
-
-            // Placement new to construct an object in memory that's already allocated.
-            new (&buffer_[write_index].data) T(data);
-            buffer_[write_index].rc = 0xffffffff;
-
-            msg_header_->wi = write_index;
-            msg_header_->cond_not_empty.Broadcast();
+            auto write_index = (msg_header_->wi[lane] + 1) % msg_header_->capacity;
+            Buffer &item = buffer_[msg_header_->Index(lane, write_index)];
+            // Connected readers that have not read the slot yet lose it
+            std::uint32_t rem_rc = item.rc & cc;
+            if (rem_rc != 0)
+            {
+                msg_header_->lapped[lane] |= rem_rc;
+                IPC_TRACE(overwrite, rem_rc, write_index);
+            }
+
+            std::uint32_t rc = keyed ? msg_header_->MatchKey(key) : 0xffffffff;
+            // Flag the readers last: a writer killed in between leaves an unflagged slot,
+            // which readers skip after recovering the mutex, instead of a torn or misplaced one.
+            // Compiler fences keep that store order, a killed process stops at an instruction.
+            item.rc = 0;
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            // Construct the object in memory that's already allocated, large payloads with streaming stores
+            ipc::copy::StoreObject(&item.data, data);
+            item.keyed = keyed;
+            item.key = key;
+            item.seq = seq;
+            item.stamp = stamp;
+            msg_header_->wi[lane] = write_index;
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            item.rc = rc;
+
+            msg_header_->heartbeat.fetch_add(1, std::memory_order_relaxed);
+            IPC_TRACE(publish, write_index, msg_header_->heartbeat.load(std::memory_order_relaxed));
+            msg_header_->Wake(rc);
             msg_header_->mutex.Unlock();
             return true;
         }
@@ -154,11 +476,226 @@ public:
         return false;
     }
 
-private:
+    // Create and initialize a fresh segment holding capacity items per lane under msg_info_.name.
+    // An unnamed one keeps its descriptor until Name.
+    bool Create(std::size_t capacity, bool unnamed = false)
+    {
+        msg_info_.size = GetTotalSize(capacity * lanes_, sizeof(Buffer));
+        // A pooled segment is sized and faulted in already. A name in use is truncated in place instead,
+        // readers of a dead writer then see the new header.
+        // A recycled one is not zeroed, only the header and the slot words readers go by are cleared below.
+        ipc::shm::segment_t seg;
+        bool pooled = !anonymous_ && ipc::shm::pool_take(unnamed ? nullptr : msg_info_.name.c_str(), msg_info_.size, seg, false);
+        int fd;
+        void *mem;
+        if (pooled)
+        {
+            fd = seg.fd_;
+            mem = seg.mem_;
+            msg_info_.size = seg.size_;
+        }
+        else
+        {
+            if (anonymous_)
+            {
+                fd = memfd_create(msg_info_.name.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            }
+            else if (unnamed)
+            {
+                fd = ipc::shm::open_unnamed();
+            }
+            else
+            {
+                int oflag = O_RDWR | O_CREAT | O_TRUNC;
+                fd = shm_open(msg_info_.name.c_str(), oflag, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+            }
+            if (fd == -1)
+            {
+                IPC_LOG_ERROR("MsgSend fail shm_open[%d]: %s", errno, msg_info_.name.c_str());
+                return false;
+            }
+            if (ftruncate(fd, static_cast<off_t>(msg_info_.size)) != 0)
+            {
+                IPC_LOG_ERROR("MsgSend fail ftruncate[%d]: %s, size = %zd", errno, msg_info_.name.c_str(), msg_info_.size);
+                close(fd);
+                return false;
+            }
+            // Readers get the descriptor itself, make sure none of them can change its size
+            if (anonymous_ && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+            {
+                IPC_LOG_ERROR("MsgSend fail F_ADD_SEALS[%d]: %s", errno, msg_info_.name.c_str());
+                close(fd);
+                return false;
+            }
+            mem = mmap(nullptr, msg_info_.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (mem == MAP_FAILED)
+            {
+                IPC_LOG_ERROR("MsgSend fail mmap[%d]: %s, size = %zd", errno, msg_info_.name.c_str(), msg_info_.size);
+                close(fd);
+                return false;
+            }
+        }
+        msg_info_.fd = fd;
+        msg_info_.mem = mem;
+        pooled_ = pooled;
+        // Place the pages before the first touch below
+        ipc::numa::BindNode(mem, msg_info_.size, numa_node_);
+
+        // Initialize the contents in shared memory
+        msg_header_ = reinterpret_cast<MsgHeader *>(mem);
+        buffer_ = reinterpret_cast<Buffer *>((uint8_t *)mem + sizeof(MsgHeader));
+        if (pooled)
+        {
+            std::memset(mem, 0, sizeof(MsgHeader));
+            for (std::size_t i = 0; i < capacity * lanes_; ++i)
+            {
+                buffer_[i].rc = 0;
+                buffer_[i].seq = 0;
+            }
+        }
+
+        msg_header_->capacity = capacity;
+        msg_header_->lanes = lanes_;
+        msg_header_->size = 0;
+        msg_header_->mutex.Open(prio_inherit_);
+        msg_header_->cond_not_empty.Open();
+        for (std::size_t i = 0; i < 32; ++i)
+        {
+            msg_header_->slots[i].cond_ready.Open();
+        }
+        msg_header_->owner.Open();
+        owner_.reset(new LockHolder());
+        if (!owner_->Acquire(msg_header_->owner))
+        {
+            Drop();
+            return false;
+        }
+        msg_header_->writer_pid = getpid();
+        // A reader may map a named segment as soon as shm_open created it, the type marks it ready
+        msg_header_->type_hash.store(msg_info_.type, std::memory_order_release);
+
+        // Anonymous segments keep their descriptor to hand it out in Accept
+        if (anonymous_ || unnamed)
+        {
+            return true;
+        }
+        // A pooled segment is named only once initialized, waiting readers attach on the IN_CREATE event
+        if (pooled)
+        {
+            if (!Name(false))
+            {
+                IPC_LOG_ERROR("MsgSend fail link[%d]: %s", errno, msg_info_.name.c_str());
+                Drop();
+                return false;
+            }
+            return true;
+        }
+        // Readers woken up early by IN_CREATE find no type yet and retry on IN_CLOSE_WRITE
+        close(fd);
+        msg_info_.fd = -1;
+        return true;
+    }
+
+    // Give the segment made by Create its name, replacing the current one if replace.
+    // A pooled segment keeps its descriptor to go back to the pool.
+    bool Name(bool replace)
+    {
+        if (pooled_)
+        {
+            ipc::shm::segment_t seg;
+            seg.fd_ = msg_info_.fd;
+            seg.mem_ = msg_info_.mem;
+            seg.size_ = msg_info_.size;
+            return ipc::shm::pool_link(seg, msg_info_.name.c_str(), replace);
+        }
+        if (!ipc::shm::link(msg_info_.fd, msg_info_.name.c_str(), replace))
+        {
+            return false;
+        }
+        close(msg_info_.fd);
+        msg_info_.fd = -1;
+        return true;
+    }
+
+    // Destroy the segment made by Create before it got its name
+    void Drop()
+    {
+        owner_.reset();
+        ipc::shm::segment_t seg;
+        seg.fd_ = msg_info_.fd;
+        seg.mem_ = msg_info_.mem;
+        seg.size_ = msg_info_.size;
+        if (!pooled_ || !ipc::shm::pool_give(seg, nullptr))
+        {
+            munmap(msg_info_.mem, msg_info_.size);
+            close(msg_info_.fd);
+        }
+    }
+
+
+
+    // Map the existing segment under msg_info_.name without touching its contents
+    bool Attach()
+    {
+        int fd = shm_open(msg_info_.name.c_str(), O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+        if (fd == -1)
+        {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) <= sizeof(MsgHeader))
+        {
+            close(fd);
+            return false;
+        }
+        msg_info_.size = static_cast<std::size_t>(st.st_size);
+        void *mem = mmap(nullptr, msg_info_.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED)
+        {
+            IPC_LOG_ERROR("MsgSend fail mmap[%d]: %s, size = %zd", errno, msg_info_.name.c_str(), msg_info_.size);
+            return false;
+        }
+        msg_info_.mem = mem;
+        msg_header_ = reinterpret_cast<MsgHeader *>(mem);
+        buffer_ = reinterpret_cast<Buffer *>((uint8_t *)mem + sizeof(MsgHeader));
+        if (msg_header_->type_hash.load(std::memory_order_acquire) != msg_info_.type)
+        {
+            IPC_LOG_ERROR("MsgSend type mismatch: %s", msg_info_.name.c_str());
+            Detach();
+            return false;
+        }
+        return true;
+    }
+
+    void Detach()
+    {
+        if (munmap(msg_info_.mem, msg_info_.size) != 0)
+        {
+            IPC_LOG_ERROR("MsgSend fail munmap[%d]: %s", errno, msg_info_.name.c_str());
+        }
+        msg_info_.mem = nullptr;
+        msg_info_.size = 0;
+    }
+
     MsgHeader *msg_header_;
     Buffer *buffer_;
     // Static buffer
     MsgInfo msg_info_;
+    // Ring depth of the current segment
+    std::size_t capacity_ = N;
+    std::size_t lanes_ = 1;
+    int numa_node_ = ipc::numa::any_node;
+    bool prio_inherit_ = false;
+    // Keeps the owner lock of the segment for as long as this writer is active, whichever thread publishes
+    std::unique_ptr<LockHolder> owner_;
+    // Channel within this process, nullptr without the intra-process path
+    std::shared_ptr<LocalTopic<T>> local_;
+    bool anonymous_ = false;
+    // Socket readers of an anonymous channel connect to for the descriptor
+    int listen_fd_ = -1;
+    // The segment came from the ipc::shm pool, its descriptor is kept to give it back
+    bool pooled_ = false;
 
     bool isValid_ = false;
 };
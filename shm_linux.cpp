@@ -3,15 +3,23 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <dirent.h>
+#include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 
 #include <atomic>
+#include <map>
+#include <mutex>
 #include <string>
 #include <utility>
+#include <vector>
+#include <cstdio>
 #include <cstring>
-#include <iostream>
+
+#include "ipc_trace.h"
+#include "shm_linux.h"
 
 namespace
 {
@@ -26,35 +34,221 @@ namespace
         void *mem_ = nullptr;
         std::size_t size_ = 0;
         std::string name_;
+        // Checked out of the segment pool, goes back to it on the last release
+        bool pooled_ = false;
+    };
+
+    struct pooled_t
+    {
+        ipc::shm::segment_t seg_;
+        // Given back as its last user left it, zeroed on checkout for callers that need it
+        bool dirty_ = false;
     };
 
+    // Segments waiting by size class
+    std::mutex pool_mutex;
+    std::map<std::size_t, std::vector<pooled_t>> pool;
+    // Segments given back while another process still mapped them, checked again on the next pool_take.
+    // Readers unmap a segment once they see its writer shut down.
+    std::vector<ipc::shm::segment_t> pool_deferred;
+    constexpr std::size_t pool_deferred_max = 16;
+    // Recycled segments by descriptor: once named, a file keeps a name in the pool directory to be linked again
+    std::map<int, std::string> pool_paths;
+    std::string pool_dir;
+    std::size_t pool_counter = 0;
+    // Process the pool belongs to, a forked child shares the pooled mappings with its parent
+    pid_t pool_pid = 0;
+
     constexpr std::size_t calc_size(std::size_t size)
     {
         return ((((size - 1) / alignof(info_t)) + 1) * alignof(info_t)) + sizeof(info_t);
     }
 
-    inline auto &acc_of(void *mem, std::size_t size)
+    inline std::atomic_size_t &acc_of(void *mem, std::size_t size)
     {
         return reinterpret_cast<info_t *>(static_cast<std::uint8_t *>(mem) + size - sizeof(info_t))->acc_;
     }
 
+    // Size class of a segment: the next power of two, one page at least
+    std::size_t class_of(std::size_t size)
+    {
+        std::size_t cls = 4096;
+        while (cls < calc_size(size))
+        {
+            cls <<= 1;
+        }
+        return cls;
+    }
+
+    // File of a shm object name, shm_open ignores leading slashes
+    std::string path_of(std::string const &name)
+    {
+        std::size_t pos = name.find_first_not_of('/');
+        return "/dev/shm/" + (pos == std::string::npos ? std::string() : name.substr(pos));
+    }
+
+    // Unlink the files of a directory and the directory
+    void remove_dir(std::string const &dir)
+    {
+        DIR *d = ::opendir(dir.c_str());
+        if (d == nullptr)
+        {
+            return;
+        }
+        while (dirent *ent = ::readdir(d))
+        {
+            if (std::strcmp(ent->d_name, ".") != 0 && std::strcmp(ent->d_name, "..") != 0)
+            {
+                ::unlink((dir + "/" + ent->d_name).c_str());
+            }
+        }
+        ::closedir(d);
+        ::rmdir(dir.c_str());
+    }
+
+    // Drop the pool inherited from the parent process after a fork, called with pool_mutex held
+    void pool_own()
+    {
+        if (pool_pid == getpid())
+        {
+            return;
+        }
+        for (auto &cls : pool)
+        {
+            for (auto &entry : cls.second)
+            {
+                munmap(entry.seg_.mem_, entry.seg_.size_);
+                close(entry.seg_.fd_);
+            }
+        }
+        for (auto &seg : pool_deferred)
+        {
+            munmap(seg.mem_, seg.size_);
+            close(seg.fd_);
+        }
+        pool.clear();
+        pool_deferred.clear();
+        pool_paths.clear();
+        pool_dir.clear();
+        pool_pid = getpid();
+    }
+
+    // Whether no other descriptor or mapping refers to the file. A write lease is only granted then;
+    // mappings count too, they keep the descriptor they were made from open. This covers a peer that
+    // opened the object and has not mapped it yet.
+    bool pool_unused(int fd)
+    {
+        if (::fcntl(fd, F_SETLEASE, F_WRLCK) != 0)
+        {
+            return false;
+        }
+        ::fcntl(fd, F_SETLEASE, F_UNLCK);
+        return true;
+    }
+
+    // Destroy a segment of the pool and its parked name, called with pool_mutex held
+    void pool_destroy(ipc::shm::segment_t const &seg)
+    {
+        munmap(seg.mem_, seg.size_);
+        close(seg.fd_);
+        auto it = pool_paths.find(seg.fd_);
+        if (it != pool_paths.end())
+        {
+            ::unlink(it->second.c_str());
+            pool_paths.erase(it);
+        }
+    }
+
+    // Move the deferred segments no other process maps anymore to the pool, called with pool_mutex held
+    void pool_retry()
+    {
+        for (auto it = pool_deferred.begin(); it != pool_deferred.end();)
+        {
+            if (pool_unused(it->fd_))
+            {
+                pooled_t entry;
+                entry.seg_ = *it;
+                entry.dirty_ = true;
+                pool[it->size_].push_back(entry);
+                it = pool_deferred.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    // Private directory recycled segments wait in, out of reach of shm_open. Directories left by
+    // processes that died are removed on the way. Called with pool_mutex held, empty on failure.
+    std::string const &pool_directory()
+    {
+        if (!pool_dir.empty())
+        {
+            return pool_dir;
+        }
+        if (DIR *d = ::opendir("/dev/shm"))
+        {
+            while (dirent *ent = ::readdir(d))
+            {
+                int pid;
+                if (std::sscanf(ent->d_name, ".ipc_pool_%d", &pid) == 1 && kill(pid, 0) != 0 && errno == ESRCH)
+                {
+                    remove_dir(std::string{"/dev/shm/"} + ent->d_name);
+                }
+            }
+            ::closedir(d);
+        }
+        std::string dir = "/dev/shm/.ipc_pool_" + std::to_string(getpid());
+        if (::mkdir(dir.c_str(), S_IRWXU) != 0 && errno != EEXIST)
+        {
+            IPC_LOG_ERROR("fail pool mkdir[%d]: %s", errno, dir.c_str());
+            return pool_dir;
+        }
+        pool_dir = std::move(dir);
+        return pool_dir;
+    }
+
+    // Create, map and fault in an unnamed segment for the pool, zeroed like a fresh one
+    bool pool_create(std::size_t cls, ipc::shm::segment_t &seg)
+    {
+        // Unnamed until checked out, yet linkable into /dev/shm with linkat
+        int fd = ipc::shm::open_unnamed();
+        if (fd == -1)
+        {
+            return false;
+        }
+        if (::ftruncate(fd, static_cast<off_t>(cls)) != 0)
+        {
+            IPC_LOG_ERROR("fail pool ftruncate[%d]: size = %zd", errno, cls);
+            close(fd);
+            return false;
+        }
+        void *mem = mmap(nullptr, cls, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED)
+        {
+            IPC_LOG_ERROR("fail pool mmap[%d]: size = %zd", errno, cls);
+            close(fd);
+            return false;
+        }
+        std::memset(mem, 0, cls);
+        seg.fd_ = fd;
+        seg.mem_ = mem;
+        seg.size_ = cls;
+        return true;
+    }
+
 } // internal-linkage
 
 namespace ipc
 {
     namespace shm
     {
-        enum : unsigned
-        {
-            create = 0x01,
-            open = 0x02
-        };
-
         void *acquire(char const *name, std::size_t size, unsigned mode)
         {
             if (name == nullptr || name[0] == '\0')
             {
-                std::cerr << "fail acquire: name is empty\n";
+                IPC_LOG_ERROR("fail acquire: name is empty");
                 return nullptr;
             }
             std::string op_name = std::string{"__IPC_SHM__"} + name;
@@ -75,10 +269,31 @@ namespace ipc
                 flag |= O_CREAT;
                 break;
             }
+            if (mode != open && size != 0)
+            {
+                // A pooled segment costs no syscall but a link, and its pages are resident already
+                segment_t seg;
+                if (pool_take(op_name.c_str(), size, seg))
+                {
+                    if (pool_link(seg, op_name.c_str(), false))
+                    {
+                        auto ii = new id_info_t();
+                        ii->fd_ = seg.fd_;
+                        ii->mem_ = seg.mem_;
+                        ii->size_ = seg.size_;
+                        ii->name_ = std::move(op_name);
+                        ii->pooled_ = true;
+                        acc_of(ii->mem_, ii->size_).fetch_add(1, std::memory_order_release);
+                        return ii;
+                    }
+                    // Created in between, open it like any existing object
+                    pool_give(seg, nullptr);
+                }
+            }
             int fd = shm_open(op_name.c_str(), flag, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
             if (fd == -1)
             {
-                printf("fail shm_open[%d]: %s\n", errno, name);
+                IPC_LOG_ERROR("fail shm_open[%d]: %s", errno, name);
                 return nullptr;
             }
             auto ii = new id_info_t();
@@ -92,7 +307,7 @@ namespace ipc
         {
             if (id == nullptr)
             {
-                printf("fail get_mem: invalid id (null)\n");
+                IPC_LOG_ERROR("fail get_mem: invalid id (null)");
                 return nullptr;
             }
             auto ii = static_cast<id_info_t *>(id);
@@ -105,7 +320,7 @@ namespace ipc
             int fd = ii->fd_;
             if (fd == -1)
             {
-                printf("fail to_mem: invalid id (fd = -1)\n");
+                IPC_LOG_ERROR("fail to_mem: invalid id (fd = -1)");
                 return nullptr;
             }
             if (ii->size_ == 0)
@@ -113,29 +328,35 @@ namespace ipc
                 struct stat st;
                 if (::fstat(fd, &st) != 0)
                 {
-                    printf("fail fstat[%d]: %s, size = %zd\n", errno, ii->name_.c_str(), ii->size_);
+                    IPC_LOG_ERROR("fail fstat[%d]: %s, size = %zd", errno, ii->name_.c_str(), ii->size_);
                     return nullptr;
                 }
                 ii->size_ = static_cast<std::size_t>(st.st_size);
                 if ((ii->size_ <= sizeof(info_t)) || (ii->size_ % sizeof(info_t)))
                 {
-                    printf("fail to_mem: %s, invalid size = %zd\n", ii->name_.c_str(), ii->size_);
+                    IPC_LOG_ERROR("fail to_mem: %s, invalid size = %zd", ii->name_.c_str(), ii->size_);
                     return nullptr;
                 }
             }
             else
             {
                 ii->size_ = calc_size(ii->size_);
-                if (::ftruncate(fd, static_cast<off_t>(ii->size_)) != 0)
+                // A segment checked out of a pool is rounded up to its size class, never shrink it
+                struct stat st;
+                if (::fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) > ii->size_)
                 {
-                    printf("fail ftruncate[%d]: %s, size = %zd\n", errno, ii->name_.c_str(), ii->size_);
+                    ii->size_ = static_cast<std::size_t>(st.st_size);
+                }
+                else if (::ftruncate(fd, static_cast<off_t>(ii->size_)) != 0)
+                {
+                    IPC_LOG_ERROR("fail ftruncate[%d]: %s, size = %zd", errno, ii->name_.c_str(), ii->size_);
                     return nullptr;
                 }
             }
             void *mem = mmap(nullptr, ii->size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
             if (mem == MAP_FAILED)
             {
-                printf("fail mmap[%d]: %s, size = %zd\n", errno, ii->name_.c_str(), ii->size_);
+                IPC_LOG_ERROR("fail mmap[%d]: %s, size = %zd", errno, ii->name_.c_str(), ii->size_);
                 return nullptr;
             }
             close(fd);
@@ -151,36 +372,50 @@ namespace ipc
         {
             if (id == nullptr)
             {
-                printf("fail release: invalid id (null)\n");
+                IPC_LOG_ERROR("fail release: invalid id (null)");
                 return;
             }
             auto ii = static_cast<id_info_t *>(id);
             if (ii->mem_ == nullptr || ii->size_ == 0)
             {
-                printf("fail release: invalid id (mem = %p, size = %zd)\n", ii->mem_, ii->size_);
+                IPC_LOG_ERROR("fail release: invalid id (mem = %p, size = %zd)", ii->mem_, ii->size_);
             }
             else if (acc_of(ii->mem_, ii->size_).fetch_sub(1, std::memory_order_acquire) == 1)
             {
+                segment_t seg;
+                seg.fd_ = ii->fd_;
+                seg.mem_ = ii->mem_;
+                seg.size_ = ii->size_;
+                if (ii->pooled_ && pool_give(seg, ii->name_.c_str()))
+                {
+                    delete ii;
+                    return;
+                }
                 munmap(ii->mem_, ii->size_);
-                if (!ii->name_.empty())
+                if (!ii->pooled_ && !ii->name_.empty())
                 {
                     shm_unlink(ii->name_.c_str());
                 }
             }
             else
                 munmap(ii->mem_, ii->size_);
-            free(ii);
+            // A pooled handle keeps its descriptor to be given back
+            if (ii->fd_ != -1)
+            {
+                close(ii->fd_);
+            }
+            delete ii;
         }
 
         void remove(void *id)
         {
             if (id == nullptr)
             {
-                printf("fail remove: invalid id (null)\n");
+                IPC_LOG_ERROR("fail remove: invalid id (null)");
                 return;
             }
-            auto ii = static_cast<id_info_t *>(id);
-            auto name = std::move(ii->name_);
+            // Copied, the handle is freed by release
+            auto name = static_cast<id_info_t *>(id)->name_;
             release(id);
             if (!name.empty())
             {
@@ -192,11 +427,221 @@ namespace ipc
         {
             if (name == nullptr || name[0] == '\0')
             {
-                printf("fail remove: name is empty\n");
+                IPC_LOG_ERROR("fail remove: name is empty");
                 return;
             }
             shm_unlink((std::string{"__IPC_SHM__"} + name).c_str());
         }
 
+        int open_unnamed()
+        {
+            int fd = ::open("/dev/shm", O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+            if (fd == -1)
+            {
+                IPC_LOG_ERROR("fail open[%d]: /dev/shm, O_TMPFILE", errno);
+            }
+            return fd;
+        }
+
+        bool link(int fd, char const *name, bool replace)
+        {
+            // The descriptor has the file even while no name in /dev/shm does
+            std::string fd_path = "/proc/self/fd/" + std::to_string(fd);
+            std::string path = path_of(name);
+            if (!replace)
+            {
+                // Fails if the name exists, the same check as O_CREAT | O_EXCL
+                if (::linkat(AT_FDCWD, fd_path.c_str(), AT_FDCWD, path.c_str(), AT_SYMLINK_FOLLOW) != 0)
+                {
+                    if (errno != EEXIST)
+                    {
+                        IPC_LOG_ERROR("fail linkat[%d]: %s", errno, name);
+                    }
+                    return false;
+                }
+                return true;
+            }
+            // linkat cannot replace a name: link in the private pool directory, then rename over it
+            std::string tmp;
+            {
+                std::lock_guard<std::mutex> lock(pool_mutex);
+                pool_own();
+                std::string const &dir = pool_directory();
+                if (dir.empty())
+                {
+                    return false;
+                }
+                tmp = dir + "/link_" + std::to_string(pool_counter++);
+            }
+            if (::linkat(AT_FDCWD, fd_path.c_str(), AT_FDCWD, tmp.c_str(), AT_SYMLINK_FOLLOW) != 0)
+            {
+                IPC_LOG_ERROR("fail linkat[%d]: %s", errno, name);
+                return false;
+            }
+            if (::rename(tmp.c_str(), path.c_str()) != 0)
+            {
+                IPC_LOG_ERROR("fail rename[%d]: %s", errno, name);
+                ::unlink(tmp.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        std::size_t pool_reserve(std::size_t size, std::size_t count)
+        {
+            if (size == 0)
+            {
+                return 0;
+            }
+            std::size_t cls = class_of(size);
+            std::size_t added = 0;
+            for (; added < count; ++added)
+            {
+                segment_t seg;
+                if (!pool_create(cls, seg))
+                {
+                    break;
+                }
+                std::lock_guard<std::mutex> lock(pool_mutex);
+                pool_own();
+                pooled_t entry;
+                entry.seg_ = seg;
+                pool[cls].push_back(entry);
+            }
+            return added;
+        }
+
+        void pool_clear()
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            pool_own();
+            for (auto &cls : pool)
+            {
+                for (auto &entry : cls.second)
+                {
+                    munmap(entry.seg_.mem_, entry.seg_.size_);
+                    close(entry.seg_.fd_);
+                }
+            }
+            for (auto &seg : pool_deferred)
+            {
+                munmap(seg.mem_, seg.size_);
+                close(seg.fd_);
+            }
+            pool.clear();
+            pool_deferred.clear();
+            pool_paths.clear();
+            if (!pool_dir.empty())
+            {
+                remove_dir(pool_dir);
+                pool_dir.clear();
+            }
+        }
+
+        bool pool_take(char const *name, std::size_t size, segment_t &seg, bool zeroed)
+        {
+            if (size == 0)
+            {
+                return false;
+            }
+            bool dirty;
+            {
+                std::lock_guard<std::mutex> lock(pool_mutex);
+                pool_own();
+                pool_retry();
+                auto it = pool.find(class_of(size));
+                if (it == pool.end() || it->second.empty())
+                {
+                    return false;
+                }
+                if (name != nullptr && ::access(path_of(name).c_str(), F_OK) == 0)
+                {
+                    return false;
+                }
+                seg = it->second.back().seg_;
+                dirty = it->second.back().dirty_;
+                it->second.pop_back();
+            }
+            // Out of the lock, only for callers reading memory they do not initialize
+            if (zeroed && dirty)
+            {
+                std::memset(seg.mem_, 0, seg.size_);
+            }
+            return true;
+        }
+
+        bool pool_link(segment_t const &seg, char const *name, bool replace)
+        {
+            if (!link(seg.fd_, name, replace))
+            {
+                return false;
+            }
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            auto it = pool_paths.find(seg.fd_);
+            if (it != pool_paths.end())
+            {
+                ::unlink(it->second.c_str());
+                pool_paths.erase(it);
+            }
+            return true;
+        }
+
+        bool pool_give(segment_t const &seg, char const *name)
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            pool_own();
+            // A file that had a name can only be linked again while it has one: park it in the pool directory
+            std::string parked;
+            auto it = pool_paths.find(seg.fd_);
+            if (it != pool_paths.end())
+            {
+                parked = std::move(it->second);
+                pool_paths.erase(it);
+            }
+            else if (name != nullptr)
+            {
+                std::string const &dir = pool_directory();
+                parked = dir + "/" + std::to_string(pool_counter++);
+                // Moved out of reach first, so no handle can be opened while checking for others
+                if (dir.empty() || ::rename(path_of(name).c_str(), parked.c_str()) != 0)
+                {
+                    ::unlink(path_of(name).c_str());
+                    return false;
+                }
+            }
+            if (!parked.empty())
+            {
+                pool_paths[seg.fd_] = std::move(parked);
+            }
+            // Still mapped elsewhere: wait for the readers to leave, the oldest waiting one is dropped
+            if (!pool_unused(seg.fd_))
+            {
+                if (pool_deferred.size() == pool_deferred_max)
+                {
+                    pool_destroy(pool_deferred.front());
+                    pool_deferred.erase(pool_deferred.begin());
+                }
+                pool_deferred.push_back(seg);
+                return true;
+            }
+            pooled_t entry;
+            entry.seg_ = seg;
+            entry.dirty_ = true;
+            pool[seg.size_].push_back(entry);
+            return true;
+        }
+
     } // namespace shm
 } // namespace ipc
+
+namespace
+{
+    // Empty the pool directory on a normal exit. After a crash, the next process to park a segment removes it.
+    struct pool_cleanup_t
+    {
+        ~pool_cleanup_t()
+        {
+            ipc::shm::pool_clear();
+        }
+    } pool_cleanup;
+} // internal-linkage
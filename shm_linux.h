@@ -0,0 +1,61 @@
+#ifndef SHM_LINUX_H
+#define SHM_LINUX_H
+
+#include <cstddef>
+
+// Named shared memory objects under /dev/shm, with a pool of pre-created segments.
+namespace ipc
+{
+    namespace shm
+    {
+        enum : unsigned
+        {
+            create = 0x01,
+            open = 0x02
+        };
+
+        // Handle to the object "__IPC_SHM__" + name, nullptr on failure. Checked out of the pool when it
+        // holds a segment of the size class, and mapped right away then.
+        void *acquire(char const *name, std::size_t size, unsigned mode);
+        // Map the object, its size is stored in *size if not null
+        void *get_mem(void *id, std::size_t *size);
+        // Unmap and free the handle. The last one unlinks the object, or gives a pooled one back.
+        void release(void *id);
+        void remove(void *id);
+        void remove(char const *name);
+
+        // Unnamed file in /dev/shm, -1 on failure. It disappears with its last descriptor and mapping unless linked.
+        int open_unnamed();
+        // Give the file of fd the shm object name. Without replace, false with errno EEXIST if the name exists;
+        // with replace, an existing object is swapped out atomically, its mappings stay valid.
+        bool link(int fd, char const *name, bool replace);
+
+        // Segment owned by the pool or checked out of it
+        struct segment_t
+        {
+            int fd_ = -1;
+            void *mem_ = nullptr;
+            std::size_t size_ = 0;
+        };
+
+        // Pre-create count segments able to hold size bytes, rounded up to a power of two, mapped and
+        // faulted in. Waiting segments have no name, nothing is left in /dev/shm if the process dies.
+        // Returns how many were added.
+        std::size_t pool_reserve(std::size_t size, std::size_t count);
+        // Destroy the segments waiting in the pool, checked out ones are not affected
+        void pool_clear();
+
+        // Check out a mapped segment of at least size bytes, still without a name. False if the pool has
+        // none of the class, or if the shm object name, when given, exists already: the caller reuses it instead.
+        // Zeroed unless zeroed is false, a recycled segment then holds what its last user left in it.
+        bool pool_take(char const *name, std::size_t size, segment_t &seg, bool zeroed = true);
+        // Publish a checked out segment as the shm object name, see link
+        bool pool_link(segment_t const &seg, char const *name, bool replace);
+        // Remove name, if not null, and take the segment back. One still mapped elsewhere is reused once no
+        // other descriptor or mapping reaches it, the pool keeps it mapped until then. False if the name could
+        // not be moved into the pool, the caller unmaps and closes the segment then.
+        bool pool_give(segment_t const &seg, char const *name);
+    } // namespace shm
+} // namespace ipc
+
+#endif
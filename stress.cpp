@@ -0,0 +1,365 @@
+#include "stress.h"
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "msg_recv.hpp"
+#include "msg_send.hpp"
+
+namespace
+{
+    const std::string stress_name = "stress_msg";
+    constexpr std::size_t max_readers = 30;
+    // Poll period of the harness while it waits for the readers to recover
+    constexpr std::size_t poll_us = 50;
+    // A reader is back to full throughput once this many messages in a row arrive at 90% of its
+    // pre-kill rate or faster. Counted rather than timed, so the window stays well under 1 ms of
+    // stall resolution at the default rate.
+    constexpr std::size_t window_msgs = 16;
+
+    using Clock = std::chrono::steady_clock;
+
+    struct StressData
+    {
+        std::uint64_t seq;
+        std::uint32_t writer;
+        std::uint8_t body[44];
+        std::uint64_t sum;
+    };
+
+    // Shared by the harness and all its children through an anonymous mapping
+    struct StressStats
+    {
+        std::atomic<std::uint64_t> next_seq;
+        std::atomic<std::uint64_t> published;
+        std::atomic<std::uint64_t> corrupt;
+        std::atomic<std::uint64_t> reordered;
+        std::atomic<int> active_writer;
+        std::atomic<std::uint64_t> received[max_readers];
+        // Recovery probe, counting only messages with a seq past mark_seq not published by dead_writer:
+        // a reader stamps the start of the first window_msgs of them received within window_ns,
+        // its pre-kill rate. Stamps are steady clock ns, shared by all processes.
+        std::atomic<std::uint64_t> mark_seq;
+        std::atomic<int> dead_writer;
+        std::atomic<std::int64_t> window_ns[max_readers];
+        std::atomic<std::int64_t> recovered_ns[max_readers];
+    };
+
+    std::int64_t NowNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    }
+
+    std::uint64_t Checksum(const StressData &d)
+    {
+        std::uint64_t h = 14695981039346656037ull ^ d.seq;
+        for (std::uint8_t b : d.body)
+        {
+            h = (h ^ b) * 1099511628211ull;
+        }
+        return h;
+    }
+
+    void Fill(StressData &d, std::uint64_t seq)
+    {
+        d.seq = seq;
+        d.writer = static_cast<std::uint32_t>(getpid());
+        for (std::size_t i = 0; i < sizeof(d.body); ++i)
+        {
+            d.body[i] = static_cast<std::uint8_t>(seq * 31 + i);
+        }
+        d.sum = Checksum(d);
+    }
+
+    void RunWriter(StressStats *stats, bool standby, std::size_t rate)
+    {
+        MsgOptions opts;
+        opts.standby = standby;
+        MsgSend<StressData, 64> msg_send(stress_name, opts);
+        if (standby && !msg_send.TakeOver())
+        {
+            _exit(1);
+        }
+        stats->active_writer = getpid();
+
+        // Paced publishing. A stall is caught up by 1 ms at most, so it shows in the throughput.
+        const std::uint64_t burst = std::max<std::uint64_t>(rate / 1000, 1);
+        Clock::time_point start = Clock::now();
+        std::uint64_t sent = 0;
+        StressData d;
+        for (;;)
+        {
+            std::uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+            std::uint64_t due = us * rate / 1000000;
+            if (due > sent + burst)
+            {
+                sent = due - burst;
+            }
+            for (; sent < due; ++sent)
+            {
+                Fill(d, stats->next_seq.fetch_add(1) + 1);
+                if (msg_send.Pub(d))
+                {
+                    stats->published++;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+
+    void RunReader(StressStats *stats, std::size_t idx)
+    {
+        MsgRecv<StressData> msg_recv(stress_name);
+        std::uint64_t last = 0;
+        StressData d;
+        // Receive times of the last window_msgs probed messages
+        std::int64_t times[window_msgs];
+        std::size_t probed = 0;
+        std::uint64_t mark = UINT64_MAX;
+        for (;;)
+        {
+            if (!msg_recv.Get(d, 10))
+            {
+                continue;
+            }
+            if (d.sum != Checksum(d))
+            {
+                stats->corrupt++;
+            }
+            else if (d.seq <= last)
+            {
+                stats->reordered++;
+            }
+            last = d.seq;
+            stats->received[idx]++;
+
+            // A new kill restarts the window
+            if (stats->mark_seq != mark)
+            {
+                mark = stats->mark_seq;
+                probed = 0;
+            }
+            if (d.seq > mark && static_cast<int>(d.writer) != stats->dead_writer)
+            {
+                std::int64_t now = NowNs();
+                std::int64_t &slot = times[probed++ % window_msgs];
+                std::int64_t start = slot;
+                slot = now;
+                if (probed > window_msgs && now - start <= stats->window_ns[idx])
+                {
+                    std::int64_t zero = 0;
+                    stats->recovered_ns[idx].compare_exchange_strong(zero, start);
+                }
+            }
+        }
+    }
+
+    template <typename F>
+    pid_t Spawn(F fn)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            fn();
+            _exit(0);
+        }
+        if (pid < 0)
+        {
+            IPC_LOG_ERROR("stress: fork failed[%d]", errno);
+        }
+        return pid;
+    }
+
+    void Reap(pid_t pid)
+    {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+
+    double Ms(Clock::duration d)
+    {
+        return std::chrono::duration<double, std::milli>(d).count();
+    }
+} // internal-linkage
+
+int RunStress(const StressOptions &opts)
+{
+    const std::size_t readers = std::min(std::max<std::size_t>(opts.readers, 1), max_readers);
+    void *mem = mmap(nullptr, sizeof(StressStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        IPC_LOG_ERROR("stress: mmap failed[%d]", errno);
+        return 1;
+    }
+    StressStats *stats = new (mem) StressStats();
+    stats->mark_seq = UINT64_MAX;
+    shm_unlink(stress_name.c_str());
+
+    auto writer = [&](bool standby) { return Spawn([=] { RunWriter(stats, standby, opts.rate); }); };
+    auto reader = [&](std::size_t idx) { return Spawn([=] { RunReader(stats, idx); }); };
+
+    pid_t writers[2];
+    writers[0] = writer(false);
+    while (stats->active_writer == 0)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    writers[1] = writer(true);
+    std::vector<pid_t> pids(readers);
+    for (std::size_t i = 0; i < readers; ++i)
+    {
+        pids[i] = reader(i);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+    std::mt19937 rng(static_cast<unsigned>(getpid()));
+    std::vector<std::uint64_t> before(readers);
+    std::vector<double> recoveries;
+    std::size_t timeouts = 0;
+    Clock::time_point end = Clock::now() + std::chrono::seconds(opts.seconds);
+    while (Clock::now() < end)
+    {
+        // Pre-kill rate of every reader, over the quiet interval
+        for (std::size_t i = 0; i < readers; ++i)
+        {
+            before[i] = stats->received[i];
+        }
+        Clock::time_point quiet = Clock::now();
+        std::this_thread::sleep_for(std::chrono::milliseconds(opts.kill_interval_ms));
+        double quiet_s = std::chrono::duration<double>(Clock::now() - quiet).count();
+        for (std::size_t i = 0; i < readers; ++i)
+        {
+            double rate = (stats->received[i] - before[i]) / quiet_s;
+            if (rate <= 0)
+            {
+                rate = static_cast<double>(opts.rate);
+            }
+            stats->window_ns[i] = static_cast<std::int64_t>(window_msgs * 1e9 / (rate * 0.9));
+        }
+
+        // Victims: the readers, then the active and the standby writer
+        std::size_t victim = rng() % (readers + 2);
+        const char *role = "reader";
+        pid_t pid;
+        if (victim < readers)
+        {
+            pid = pids[victim];
+        }
+        else
+        {
+            std::size_t w = (writers[0] == stats->active_writer) == (victim == readers) ? 0 : 1;
+            role = victim == readers ? "writer" : "standby";
+            pid = writers[w];
+            victim = readers + w;
+        }
+        // Arm the probe: only messages published after the kill, by a live writer, count.
+        // Readers restart their window when they see the new mark.
+        stats->mark_seq = UINT64_MAX;
+        for (std::size_t i = 0; i < readers; ++i)
+        {
+            stats->recovered_ns[i] = 0;
+        }
+        stats->dead_writer = victim < readers ? 0 : pid;
+        Clock::time_point t0 = Clock::now();
+        const std::int64_t t0_ns = NowNs();
+        stats->mark_seq = stats->next_seq.load();
+        Reap(pid);
+        if (victim < readers)
+        {
+            pids[victim] = reader(victim);
+        }
+        else
+        {
+            writers[victim - readers] = writer(true);
+        }
+
+        // Recovered once every surviving reader is back to its pre-kill rate, measured from the kill
+        // to the start of the slowest reader's first full-rate window
+        double recovery = -1;
+        while (Ms(Clock::now() - t0) < opts.max_recovery_ms)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(poll_us));
+            std::int64_t last_ns = 0;
+            for (std::size_t i = 0; i < readers && last_ns >= 0; ++i)
+            {
+                if (i == victim)
+                {
+                    continue;
+                }
+                std::int64_t ns = stats->recovered_ns[i];
+                // A stamp left by a reader that saw the previous mark, re-arm it
+                if (ns != 0 && ns < t0_ns)
+                {
+                    stats->recovered_ns[i].compare_exchange_strong(ns, 0);
+                    ns = 0;
+                }
+                last_ns = ns == 0 ? -1 : std::max(last_ns, ns);
+            }
+            if (last_ns >= 0)
+            {
+                recovery = (last_ns - t0_ns) / 1e6;
+                break;
+            }
+        }
+
+        if (recovery < 0 || recovery > opts.max_recovery_ms)
+        {
+            timeouts++;
+            printf("kill %s %d: not recovered within %zu ms\n", role, pid, opts.max_recovery_ms);
+        }
+        else
+        {
+            recoveries.push_back(recovery);
+            printf("kill %s %d: back to full rate in %.2f ms\n", role, pid, recovery);
+        }
+        fflush(stdout);
+    }
+
+    for (pid_t pid : pids)
+    {
+        Reap(pid);
+    }
+    Reap(writers[0]);
+    Reap(writers[1]);
+    shm_unlink(stress_name.c_str());
+
+    std::uint64_t received = 0;
+    for (std::size_t i = 0; i < readers; ++i)
+    {
+        received += stats->received[i];
+    }
+    std::sort(recoveries.begin(), recoveries.end());
+    double sum = 0;
+    for (double r : recoveries)
+    {
+        sum += r;
+    }
+    printf("published %llu, received %llu, corrupt %llu, reordered %llu\n",
+           static_cast<unsigned long long>(stats->published.load()), static_cast<unsigned long long>(received),
+           static_cast<unsigned long long>(stats->corrupt.load()), static_cast<unsigned long long>(stats->reordered.load()));
+    if (!recoveries.empty())
+    {
+        printf("recovery ms: avg %.2f, p50 %.2f, max %.2f, timeouts %zu\n", sum / recoveries.size(),
+               recoveries[recoveries.size() / 2], recoveries.back(), timeouts);
+    }
+    else if (timeouts != 0)
+    {
+        printf("recovery: timeouts %zu\n", timeouts);
+    }
+
+    bool ok = stats->corrupt == 0 && stats->reordered == 0 && timeouts == 0;
+    munmap(mem, sizeof(StressStats));
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,26 @@
+#ifndef STRESS_H
+#define STRESS_H
+
+#include <cstddef>
+
+// Crash stress of a channel: writer and reader processes are killed with SIGKILL at random
+// while messages flow, then timed until every surviving reader receives messages published after the kill
+// at its pre-kill rate again.
+struct StressOptions
+{
+    // Run time of the kill loop
+    std::size_t seconds = 10;
+    std::size_t readers = 4;
+    // Publish rate of the active writer, messages per second
+    std::size_t rate = 20000;
+    // Time between two kills
+    std::size_t kill_interval_ms = 200;
+    // Fail the run when one recovery takes longer
+    std::size_t max_recovery_ms = 1000;
+};
+
+// Returns 0 when no corrupt or reordered message was seen and every recovery stayed within
+// max_recovery_ms, 1 otherwise. Prints the recovery latencies to stdout.
+int RunStress(const StressOptions &opts);
+
+#endif